@@ -1,302 +1,2106 @@
 #include "alloc.h"
 
 // global state
+// block size of each class in words: 2-word steps up to 8 words, then four
+// classes per doubling; the top class takes everything bigger
 const word SIZE_CLASS_LIMITS[NUM_SIZE_CLASSES] = {
-    8, 16, 32, 64, 128, 256, 512, ~0u
+    2, 4, 6, 8,
+    10, 12, 14, 16,
+    20, 24, 28, 32,
+    40, 48, 56, 64,
+    80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+    ~0u
 };
 
-// segregated free lists - one per size class
-header *free_lists[NUM_SIZE_CLASSES] = {NULL};
+// an arena is an independent heap of blocks with its own segments, free
+// lists and locks; threads are spread over the arenas so their slow paths
+// rarely meet on the same lock. a block's arena is that of its segment, so
+// blocks are always freed and coalesced into the arena they came from
+typedef struct {
+    // segregated free lists - one per size class
+    header *free_lists[NUM_SIZE_CLASSES];
+
+    // bit i set while free_lists[i] is non-empty, so a miss can find the
+    // next populated larger class without locking every class on the way
+    _Atomic uint64_t free_list_bits;
+
+    // per-size-class mutexes for fine-grained locking
+    pthread_mutex_t locks[NUM_SIZE_CLASSES];
+
+    // blocks and words on each free list, kept under the class's lock
+    word free_blocks[NUM_SIZE_CLASSES];
+    size_t free_words[NUM_SIZE_CLASSES];
+
+    // unclaimed part of the current segment: word offsets of its start (low
+    // 32 bits) and of the segment's epilogue (high 32 bits), so threads
+    // claim spans with a single CAS and then bump allocate without locks
+    _Atomic uint64_t top;
+
+    // mutex for heap expansion
+    pthread_mutex_t expand_lock;
+
+    int node;                    // NUMA node its segments are bound to
+    atomic_size_t mapped;        // bytes of block segments it has mapped
+    atomic_size_t remote_frees;  // blocks freed into it by threads of other nodes
+} arena_t;
+
+_Static_assert(NUM_SIZE_CLASSES <= 64, "free_list_bits has one bit per class");
+_Static_assert(MAX_ARENAS <= 256, "segment_arenas has one byte per segment");
 
-// per-size-class mutexes for fine-grained locking
-pthread_mutex_t size_class_locks[NUM_SIZE_CLASSES] = {
-    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
-    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
-    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
-    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+static arena_t arenas[MAX_ARENAS] = {
+    [0 ... MAX_ARENAS - 1] = {
+        .locks = { [0 ... NUM_SIZE_CLASSES - 1] = PTHREAD_MUTEX_INITIALIZER },
+        .expand_lock = PTHREAD_MUTEX_INITIALIZER,
+    }
 };
 
-// mutex for heap expansion
-pthread_mutex_t heap_expand_lock = PTHREAD_MUTEX_INITIALIZER;
+#define ARENA_OF(ptr) (&arenas[SEGMENT_ARENA(ptr)])
+
+// arenas in use, 0 until the first thread picks one
+static atomic_int num_arenas = 0;
+static atomic_int arena_assign = ARENA_ROUND_ROBIN;
+static atomic_uint next_arena = 0;
+
+// NUMA layout, read once; arena i serves node i % num_nodes
+static int num_nodes = 1;
+static atomic_bool numa_enabled = false;
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+// arena serving the calling thread's block slow paths, and how often it
+// has waited for one of that arena's locks since it was assigned
+static __thread arena_t *thread_arena = NULL;
+static __thread int arena_waits = 0;
+
+static __thread char *span_top = NULL;
+static __thread char *span_end = NULL;
+
+// set when the last block allocated was carved from never touched memory,
+// so alloc_calloc() knows it is already zero
+static __thread bool fresh_memory = false;
+
+// decay-based purging of free pages back to the OS
+static atomic_long decay_ms = PURGE_DECAY_MS;
+static atomic_uint next_purge_ms = 0;
+static pthread_mutex_t purge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// background purge thread, off unless alloc_background_purge(true)
+static pthread_t purge_thread;
+static bool purge_thread_running = false;
+static pthread_mutex_t purge_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t purge_thread_cond = PTHREAD_COND_INITIALIZER;
 
-// track end of allocated heap
-static header *heap_top = NULL;
+// bookkeeping kept in the payload of blocks sitting in free_lists, so
+// allocated blocks pay nothing for it
+typedef struct {
+    word next_offset;    // offset to next block in free list (0 if last)
+    word prev_offset;    // offset to previous block in free list (0 if head)
+    word freed_at;       // ms clock when a page-sized block was freed, 0 once purged
+} free_payload;
+
+// header in front of a large object, padded to keep the payload 16-byte aligned
+typedef struct {
+    size_t size;         // bytes mapped, including this header
+    size_t offset;       // bytes mapped before this header, to align the payload
+    size_t sampled;      // bytes asked for if the heap profiler sampled it, else 0
+    word stack;          // the sample's stack id in the profile
+} __attribute__((aligned(16))) large_header;
 
 // thread-local caches, one cache per size class per thread
-// each cache is a simple stack of free blocks
+// each cache is a simple stack of free payload pointers, slab objects for
+// the small classes and block payloads for the rest
+__thread thread_cache_t thread_caches[NUM_SIZE_CLASSES] = {0};
+static __thread bool thread_cache_disabled = false;
+
+// with per-CPU caching on, the small classes are cached per CPU in
+// percpu.c and the thread caches only serve threads without rseq
+static atomic_bool percpu_enabled = false;
+
+// bytes of cache capacity granted beyond each cache's first batch, summed
+// over all threads and capped at THREAD_CACHE_BUDGET
+static atomic_size_t cache_budget_used = 0;
+
+// threads that hold cached blocks or a span set a value under this key, so
+// its destructor hands everything back when they exit
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_once = PTHREAD_ONCE_INIT;
+static __thread bool thread_registered = false;
+
+// remote frees: a slab object freed by a thread other than its slab's owner
+// is pushed onto the owner's list with one CAS, and the owner takes the
+// whole list back into its cache on its next refill, so memory handed from
+// a producer to a consumer comes back to the producer. any thread pushes,
+// only the owner drains, so exchanging the head for 0 is ABA-free
+typedef struct {
+    _Atomic word remote;     // offset of the first object, chained through CHAIN_NEXT
+    atomic_bool alive;       // false once the owner has exited
+    thread_cache_t *caches;  // the owner's thread_caches, under thread_heap_lock
+} thread_heap_t;
+
+// heap id 0 means "no owner"
+static thread_heap_t thread_heaps[MAX_THREAD_HEAPS + 1];
+static word free_heap_ids[MAX_THREAD_HEAPS];
+static int num_free_heap_ids = 0;
+static word next_heap_id = 1;
+static pthread_mutex_t thread_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread word heap_id = 0;
+
+// the owner is the only writer of its caches' counts; alloc_heap_report()
+// reads them from other threads
+static inline void set_cached(thread_cache_t *cache, int count) {
+    __atomic_store_n(&cache->count, count, __ATOMIC_RELAXED);
+}
+
+// the calling thread's event counters: the stats slot of its heap id
+static __thread thread_stats_t *my_stats = &thread_stats[0];
+
+#define STAT(class, field, n) stat_add(&my_stats->classes[class].field, (n))
+
+static inline void count_alloc(int class, size_t bytes) {
+    STAT(class, allocs, 1);
+    STAT(class, alloc_bytes, bytes);
+}
+
+static inline void count_free(int class, size_t bytes) {
+    STAT(class, frees, 1);
+    STAT(class, free_bytes, bytes);
+}
+
+// with -DALLOC_LATENCY the public entry points time each operation and
+// file it under the last path it marked with LATENCY_PATH
+#ifdef ALLOC_LATENCY
+#define LATENCY_START(path) uint64_t latency_start = latency_now(); LATENCY_PATH(path)
+#define LATENCY_END() latency_record(latency_path, latency_now() - latency_start)
+#else
+#define LATENCY_START(path) ((void)0)
+#define LATENCY_END() ((void)0)
+#endif
+
+// slab objects are all their class's size, so their bytes are worked out
+// when the counters are summed
+#define count_slab_alloc(class) STAT(class, allocs, 1)
+#define count_slab_free(class) STAT(class, frees, 1)
+
+// give the calling thread a heap id, or leave it at 0 if all are taken
+static void acquire_thread_heap(void) {
+    pthread_mutex_lock(&thread_heap_lock);
+    if (num_free_heap_ids > 0) {
+        heap_id = free_heap_ids[--num_free_heap_ids];
+    } else if (next_heap_id <= MAX_THREAD_HEAPS) {
+        heap_id = next_heap_id++;
+    }
+    if (heap_id != 0) thread_heaps[heap_id].caches = thread_caches;
+    pthread_mutex_unlock(&thread_heap_lock);
+
+    if (heap_id != 0) {
+        atomic_store(&thread_heaps[heap_id].alive, true);
+        my_stats = &thread_stats[heap_id];
+        stats_attach();
+    }
+}
+
+static void take_remote_frees(bool to_cache);
+
+static void release_thread_heap(void) {
+    if (heap_id == 0) return;
+
+    // pushers re-check `alive` after pushing, so nothing is stranded
+    atomic_store(&thread_heaps[heap_id].alive, false);
+    take_remote_frees(false);
+
+    stats_detach(my_stats);
+    my_stats = &thread_stats[0];
+
+    pthread_mutex_lock(&thread_heap_lock);
+    thread_heaps[heap_id].caches = NULL;
+    free_heap_ids[num_free_heap_ids++] = heap_id;
+    pthread_mutex_unlock(&thread_heap_lock);
+    heap_id = 0;
+}
+
+static void thread_exit_flush(void *arg) {
+    (void)arg;
+    alloc_thread_flush();
+    release_thread_heap();
+
+    // destructors that run after this one may still allocate; registering
+    // again sets the key anew, so this runs once more after them
+    thread_registered = false;
+}
+
+static void create_thread_exit_key(void) {
+    pthread_key_create(&thread_exit_key, thread_exit_flush);
+}
+
+// arm the exit destructor the first time a thread keeps memory of its own;
+// the flag is set first because pthread_setspecific may itself allocate
+static inline void register_thread(void) {
+    if (thread_registered) return;
+    thread_registered = true;
+
+    pthread_once(&thread_exit_once, create_thread_exit_key);
+    pthread_setspecific(thread_exit_key, (void *)1);
+    if (heap_id == 0) acquire_thread_heap();
+}
+
+// central stash of full batches between the thread caches and the slabs or
+// free lists; a batch is a chain of one batch_size() of objects linked through
+// their first word, so it moves in or out in O(1)
+#ifdef LOCKFREE_LISTS
+// Treiber stack of chains linked through the second word of their first
+// object: `top` packs that object's word offset in the low 32 bits and a
+// generation bumped by every push and pop in the high 32, so a pop never
+// succeeds against a head that left the stack and came back
 typedef struct {
-    header *blocks[THREAD_CACHE_SIZE];
+    _Atomic uint64_t top;
+    atomic_int count;
+} transfer_cache_t;
+
+static transfer_cache_t transfer_caches[TOP_CLASS];
+#else
+typedef struct {
+    void *batches[TRANSFER_BATCHES];
     int count;
-} thread_cache_t;
+    pthread_mutex_t lock;
+} transfer_cache_t;
 
-__thread thread_cache_t thread_caches[NUM_SIZE_CLASSES] = {0};
+static transfer_cache_t transfer_caches[TOP_CLASS] = {
+    [0 ... TOP_CLASS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+#endif
+
+// objects parked in each class's transfer cache; a pop may be counted
+// before the push it undoes, so it can dip below zero for a moment
+static atomic_long transfer_objects[TOP_CLASS];
+
+// word offsets of the next object in a chain and of the next chain on a
+// lock-free transfer stack; every object has room for both
+#define CHAIN_NEXT(obj) (((word *)(obj))[0])
+#define CHAIN_LINK(obj) (((word *)(obj))[1])
 
-#define WORDS_TO_BYTES(w) ((w) * sizeof(word))
 #define BYTES_TO_WORDS(b) (((b) + sizeof(word) - 1) / sizeof(word))
 #define OVERHEAD_WORDS (OVERHEAD / sizeof(word))
+#define ALIGN_WORDS (ALLOC_ALIGN / sizeof(word))
+// payload words of a block holding at least w, rounded so the block and its
+// header span a multiple of ALLOC_ALIGN and the next payload stays aligned
+#define BLOCK_WORDS(w) \
+    ((((w) + OVERHEAD_WORDS + ALIGN_WORDS - 1) & ~(ALIGN_WORDS - 1)) - OVERHEAD_WORDS)
+#define MIN_BLOCK_WORDS BLOCK_WORDS(4)  // room for a free_payload
+#define MIN_BLOCK_BYTES (OVERHEAD + WORDS_TO_BYTES(MIN_BLOCK_WORDS))
+#define GET_PAYLOAD(hdr) ((void *)((char *)(hdr) + HEADER_SIZE))
+#define GET_HEADER(ptr) ((header *)((char *)(ptr) - HEADER_SIZE))
 
+_Static_assert(sizeof(free_payload) <= MIN_BLOCK_WORDS * sizeof(word),
+               "every free block holds its list links");
+
+// offsets are in words so 32 bits cover the whole reservation; offset 0 is
+// the first segment's prologue and never a block, so it doubles as NULL
 static inline word ptr_to_offset(header *ptr) {
     if (ptr == NULL) return 0;
-    return (word)((char *)ptr - (char *)memspace);
+    return (word)(((char *)ptr - heap_base) / sizeof(word));
 }
 
 static inline header *offset_to_ptr(word offset) {
     if (offset == 0) return NULL;
-    return (header *)((char *)memspace + offset);
+    return (header *)(heap_base + WORDS_TO_BYTES((size_t)offset));
+}
+
+// large objects are the only pointers handed out from outside the reservation
+static inline bool in_heap(void *ptr) {
+    return heap_base != NULL && (uintptr_t)((char *)ptr - heap_base) < HEAP_RESERVE;
 }
 
+// class serving a request of `words` (rounds up), computed from the position
+// of the highest set bit: 2^k < words <= 2^(k+1) falls in group k, whose
+// four classes are 2^(k-2) words apart
 static inline int get_size_class(word words) {
-    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
-        if (words <= SIZE_CLASS_LIMITS[i]) {
-            return i;
-        }
+    if (words <= 8) return words <= 2 ? 0 : (int)(words - 1) / 2;
+    if (words > MAX_CLASS_WORDS) return TOP_CLASS;
+
+    int k = 31 - __builtin_clz(words - 1);
+    return 4 * (k - 2) + (int)((words - 1 - (1u << k)) >> (k - 2));
+}
+
+// class whose list a free block of `words` goes on (rounds down), so every
+// block on list i is at least SIZE_CLASS_LIMITS[i] words
+static inline int get_free_class(word words) {
+    int class = get_size_class(words);
+    if (class != TOP_CLASS && SIZE_CLASS_LIMITS[class] > words) class--;
+    return class;
+}
+
+// arenas to spread threads over, ARENAS_PER_CPU per CPU unless set
+static int arena_count(void) {
+    int n = atomic_load_explicit(&num_arenas, memory_order_relaxed);
+    if (n > 0) return n;
+
+    // the CPUs this process may run on; unlike sysconf this never allocates
+    cpu_set_t set;
+    int cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : 1;
+    n = (cpus < MAX_ARENAS ? cpus : MAX_ARENAS) * ARENAS_PER_CPU;
+    if (n > MAX_ARENAS) n = MAX_ARENAS;
+
+    int unset = 0;
+    if (!atomic_compare_exchange_strong(&num_arenas, &unset, n)) n = unset;
+    return n;
+}
+
+// spread the arenas over the online nodes, and bind them by default when
+// there is more than one
+static void numa_setup(void) {
+    int nodes = heap_numa_nodes();
+    num_nodes = nodes < 1 ? 1 : nodes < MAX_NUMA_NODES ? nodes : MAX_NUMA_NODES;
+    for (int i = 0; i < MAX_ARENAS; i++) {
+        arenas[i].node = i % num_nodes;
     }
-    return NUM_SIZE_CLASSES - 1;
+    atomic_store(&numa_enabled, num_nodes > 1);
 }
 
-// add block to appropriate free list (assumes caller holds correct lock)
-static void add_to_free_list(header *hdr) {
-    int class = get_size_class(hdr->w);
-    hdr->next_offset = ptr_to_offset(free_lists[class]);
-    free_lists[class] = hdr;
+// (re)assign the calling thread an arena: the next one in turn, or the one
+// of the CPU it runs on, among the arenas of its NUMA node. a thread moving
+// away from contention never gets its old arena back
+static void assign_arena(void) {
+    pthread_once(&numa_once, numa_setup);
+    int n = arena_count();
+
+    // with NUMA off, or fewer arenas than nodes, any arena will do
+    int nodes = 1, node = 0;
+    if (atomic_load_explicit(&numa_enabled, memory_order_relaxed) && n >= num_nodes) {
+        nodes = num_nodes;
+        node = heap_current_node() % nodes;
+    }
+    int per_node = (n - node + nodes - 1) / nodes;
+
+    int k;
+    if (atomic_load_explicit(&arena_assign, memory_order_relaxed) == ARENA_BY_CPU) {
+        int cpu = sched_getcpu();
+        k = cpu >= 0 ? cpu / nodes : 0;
+    } else {
+        k = (int)atomic_fetch_add_explicit(&next_arena, 1, memory_order_relaxed);
+    }
+
+    int i = node + nodes * (k % per_node);
+    if (thread_arena == &arenas[i]) i = node + nodes * ((k + 1) % per_node);
+
+    thread_arena = &arenas[i];
+    arena_waits = 0;
+}
+
+static inline arena_t *my_arena(void) {
+    if (thread_arena == NULL) assign_arena();
+    return thread_arena;
 }
 
-// remove block from free list - returns true if found
-static bool remove_from_free_list_checked(header *hdr) {
-    int class = get_size_class(hdr->w);
+// lock a class of an arena; a thread that keeps finding its own arena's
+// locks taken moves to another arena for its next slow path
+static inline void lock_class(arena_t *a, int class) {
+    if (pthread_mutex_trylock(&a->locks[class]) == 0) return;
 
-    if (free_lists[class] == hdr) {
-        free_lists[class] = offset_to_ptr(hdr->next_offset);
-        hdr->next_offset = 0;
-        return true;
+    STAT(class, lock_waits, 1);
+    if (a == thread_arena && ++arena_waits >= ARENA_CONTENTION) assign_arena();
+    pthread_mutex_lock(&a->locks[class]);
+}
+
+static inline void unlock_class(arena_t *a, int class) {
+    pthread_mutex_unlock(&a->locks[class]);
+}
+
+// keep free_list_bits in step with free_lists[class] (assumes caller holds its lock)
+static inline void sync_free_list_bit(arena_t *a, int class) {
+    uint64_t bit = 1ull << class;
+    bool listed = (atomic_load_explicit(&a->free_list_bits, memory_order_relaxed) & bit) != 0;
+
+    if (a->free_lists[class] && !listed) {
+        atomic_fetch_or_explicit(&a->free_list_bits, bit, memory_order_relaxed);
+    } else if (!a->free_lists[class] && listed) {
+        atomic_fetch_and_explicit(&a->free_list_bits, ~bit, memory_order_relaxed);
     }
+}
 
-    header *curr = free_lists[class];
-    while (curr) {
-        if (offset_to_ptr(curr->next_offset) == hdr) {
-            curr->next_offset = hdr->next_offset;
-            hdr->next_offset = 0;
-            return true;
-        }
-        curr = offset_to_ptr(curr->next_offset);
+// millisecond clock for purge ages; 0 is reserved for "already purged"
+word now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    word ms = (word)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+    return ms ? ms : 1;
+}
+
+// remember when a block big enough to purge entered the global free lists
+// (assumes caller holds the block's size class lock)
+static inline void stamp_free_block(header *hdr) {
+    if (WORDS_TO_BYTES(block_words(hdr)) > heap_page_size) {
+        ((free_payload *)GET_PAYLOAD(hdr))->freed_at = now_ms();
     }
+}
+
+#define GET_FREE_PAYLOAD(hdr) ((free_payload *)GET_PAYLOAD(hdr))
+
+// add block to appropriate free list of its arena (assumes caller holds
+// correct lock), then write its footer into the next header and set that
+// header's BLOCK_PREV_FREE, from which point the next block's owner may
+// claim it
+static void add_to_free_list(header *hdr) {
+    arena_t *a = ARENA_OF(hdr);
+    word w = block_words(hdr);
+    int class = get_free_class(w);
+    header *head = a->free_lists[class];
+
+    stamp_free_block(hdr);
+    GET_FREE_PAYLOAD(hdr)->next_offset = ptr_to_offset(head);
+    GET_FREE_PAYLOAD(hdr)->prev_offset = 0;
+    if (head) GET_FREE_PAYLOAD(head)->prev_offset = ptr_to_offset(hdr);
+
+    a->free_lists[class] = hdr;
+    a->free_blocks[class]++;
+    a->free_words[class] += w;
+    __atomic_fetch_or(&hdr->info, BLOCK_LISTED, __ATOMIC_RELAXED);
+    sync_free_list_bit(a, class);
+
+    header *next = GET_NEXT_HEADER(hdr);
+    next->prev_w = w;
+    __atomic_fetch_or(&next->info, BLOCK_PREV_FREE, __ATOMIC_RELEASE);
+}
 
-    return false;
+// unlink block from its free list in O(1) (assumes caller holds the lock
+// and has claimed the block)
+static void remove_from_free_list(header *hdr, int class) {
+    arena_t *a = ARENA_OF(hdr);
+    free_payload *fp = GET_FREE_PAYLOAD(hdr);
+    header *prev = offset_to_ptr(fp->prev_offset);
+    header *next = offset_to_ptr(fp->next_offset);
+
+    if (prev) {
+        GET_FREE_PAYLOAD(prev)->next_offset = fp->next_offset;
+    } else {
+        a->free_lists[class] = next;
+        sync_free_list_bit(a, class);
+    }
+    if (next) GET_FREE_PAYLOAD(next)->prev_offset = fp->prev_offset;
+    a->free_blocks[class]--;
+    a->free_words[class] -= block_words(hdr);
+
+    fp->next_offset = 0;
+    __atomic_fetch_and(&hdr->info, ~BLOCK_LISTED, __ATOMIC_RELAXED);
+}
+
+// a listed block belongs to whoever clears BLOCK_PREV_FREE in the header
+// after it: the owner of that next block merging backward, or a thread
+// holding the block's class lock that wants to hand it out or merge it
+// forward. only the winner may unlink it, so a block the next owner is
+// about to merge is never handed out from under it
+static inline bool claim_listed(header *hdr) {
+    header *next = GET_NEXT_HEADER(hdr);
+    return (__atomic_fetch_and(&next->info, ~BLOCK_PREV_FREE, __ATOMIC_ACQUIRE) &
+            BLOCK_PREV_FREE) != 0;
+}
+
+// unlink the first block of a free list the caller can claim, skipping any
+// the next block's owner is merging (assumes caller holds the lock)
+static header *take_listed(arena_t *a, int class) {
+    header *hdr = a->free_lists[class];
+    while (hdr && !claim_listed(hdr)) {
+        hdr = offset_to_ptr(GET_FREE_PAYLOAD(hdr)->next_offset);
+    }
+    if (hdr) remove_from_free_list(hdr, class);
+    return hdr;
 }
 
-// initialize block header and footer
+// write the header of a block the caller owns; BLOCK_PREV_FREE is kept, as
+// whoever lists or claims the previous block may change it at any time
 static void set_block_metadata(header *hdr, word size, bool is_alloced) {
-    hdr->w = size;
-    hdr->alloced = is_alloced;
+    word info = size << BLOCK_FLAG_BITS | (is_alloced ? BLOCK_ALLOCED : 0);
+    word old = block_info(hdr);
+    while (!__atomic_compare_exchange_n(&hdr->info, &old, (old & BLOCK_PREV_FREE) | info,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
 
-    footer *ftr = GET_FOOTER(hdr);
-    ftr->w = size;
-    ftr->alloced = is_alloced;
+// header of a block cut from the inside of one the caller owns, so the
+// block before it is the caller's and BLOCK_PREV_FREE starts clear
+static void init_block_metadata(header *hdr, word size, bool is_alloced) {
+    __atomic_store_n(&hdr->info, size << BLOCK_FLAG_BITS | (is_alloced ? BLOCK_ALLOCED : 0),
+                     __ATOMIC_RELAXED);
 }
 
-// allocate a new block from uninitialized memory
-static void *allocate_from_fresh_memory(word words, header *hdr) {
-    if (hdr == NULL) return NULL;
+// flip an owned block between allocated and cached
+static inline void set_block_alloced(header *hdr, bool alloced) {
+    if (alloced) {
+        __atomic_fetch_or(&hdr->info, BLOCK_ALLOCED, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&hdr->info, ~BLOCK_ALLOCED, __ATOMIC_RELAXED);
+    }
+}
 
-    ptrdiff_t bytes_in = (char *)hdr - (char *)memspace;
-    word words_in = BYTES_TO_WORDS(bytes_in);
+// map a segment of blocks for an arena and move its top into it (assumes
+// caller holds the arena's expand_lock); the prologue keeps the first
+// block off offset 0 and the epilogue, an allocated empty block, stops
+// coalescing at the end, so blocks never cross arenas
+static bool grow_heap(arena_t *a) {
+    segment_t *seg = heap_map_segment(SEGMENT_SIZE, SEGMENT_BLOCKS, (int)(a - arenas));
+    if (seg == NULL) return false;
 
-    if (words > (MAXWORDS - words_in)) {
-        reterr(err_no_mem);
+    // placement is a preference, so a failed bind still leaves usable memory
+    if (atomic_load_explicit(&numa_enabled, memory_order_relaxed)) {
+        heap_bind_node(seg->base, seg->size, a->node);
     }
+    atomic_fetch_add_explicit(&a->mapped, seg->size, memory_order_relaxed);
 
-    hdr->w = words;
-    hdr->alloced = true;
+    header *epilogue = (header *)(seg->base + seg->size - HEADER_SIZE);
+    init_block_metadata(epilogue, 0, true);
+
+    uint64_t top = ptr_to_offset((header *)(seg->base + HEADER_SIZE));
+    atomic_store_explicit(&a->top, (uint64_t)ptr_to_offset(epilogue) << 32 | top,
+                          memory_order_release);
+    return true;
+}
 
-    footer *ftr = GET_FOOTER(hdr);
-    ftr->w = words;
-    ftr->alloced = true;
+// allocate a new block from uninitialized memory; the block before it may
+// already have been freed, so its BLOCK_PREV_FREE is kept
+static void *allocate_from_fresh_memory(word words, header *hdr) {
+    if (hdr == NULL) return NULL;
 
+    set_block_metadata(hdr, words, true);
     return (void *)((char *)hdr + HEADER_SIZE);
 }
 
 // split block into allocated part and free remainder
 static void *split_block(header *hdr, word requested_words) {
-    word old_size = hdr->w;
+    word old_size = block_words(hdr);
 
     // set up allocated block
     set_block_metadata(hdr, requested_words, true);
     void *ret = (void *)((char *)hdr + HEADER_SIZE);
 
     // create remainder block
-    footer *ftr = GET_FOOTER(hdr);
-    header *remainder = (header *)((char *)ftr + FOOTER_SIZE);
-    set_block_metadata(remainder, old_size - requested_words - OVERHEAD_WORDS, false);
+    header *remainder = GET_NEXT_HEADER(hdr);
+    init_block_metadata(remainder, old_size - requested_words - OVERHEAD_WORDS, false);
 
     // add remainder to free list
+    arena_t *a = ARENA_OF(remainder);
+    int class = get_free_class(block_words(remainder));
+    lock_class(a, class);
     add_to_free_list(remainder);
+    unlock_class(a, class);
 
     return ret;
 }
 
-// refill thread cache from global free list
-// returns true if successful, false if global list is empty
-static bool refill_thread_cache(int size_class) {
-    pthread_mutex_lock(&size_class_locks[size_class]);
-    
-    thread_cache_t *cache = &thread_caches[size_class];
-    int refill_count = THREAD_CACHE_SIZE / 2;  // refill to half capacity
-    
-    for (int i = 0; i < refill_count && free_lists[size_class] != NULL; i++) {
-        header *hdr = free_lists[size_class];
-        free_lists[size_class] = offset_to_ptr(hdr->next_offset);
-        hdr->next_offset = 0;
-        
-        cache->blocks[cache->count++] = hdr;
+// take the block after an owned one off its free list so it can be
+// merged; fails if it is allocated, cached or claimed by another thread
+static bool claim_next(header *nb) {
+    word info = block_info(nb);
+    if (!(info & BLOCK_LISTED)) return false;
+
+    // a listed block only changes while its class lock is held
+    word w = info >> BLOCK_FLAG_BITS;
+    arena_t *a = ARENA_OF(nb);
+    int class = get_free_class(w);
+    lock_class(a, class);
+
+    bool ok = block_listed(nb) && block_words(nb) == w && claim_listed(nb);
+    if (ok) remove_from_free_list(nb, class);
+
+    unlock_class(a, class);
+    return ok;
+}
+
+// merge an owned free block with free neighbours on the shared lists;
+// returns the merged block, still owned by the caller
+static header *coalesce(header *hdr) {
+    // forward: the block right after us, if it is free and listed
+    header *next = GET_NEXT_HEADER(hdr);
+    if (claim_next(next)) {
+        set_block_metadata(hdr, block_words(hdr) + block_words(next) + OVERHEAD_WORDS, false);
     }
-    
-    pthread_mutex_unlock(&size_class_locks[size_class]);
-    
-    return cache->count > 0;
+
+    // backward: winning our own BLOCK_PREV_FREE hands us the listed block
+    // before us, whose footer is then valid. a segment's first block never
+    // has it set
+    if (__atomic_fetch_and(&hdr->info, ~BLOCK_PREV_FREE, __ATOMIC_ACQUIRE) & BLOCK_PREV_FREE) {
+        word prev_w = hdr->prev_w;
+        header *prev = (header *)((char *)hdr - WORDS_TO_BYTES(prev_w) - HEADER_SIZE);
+
+        arena_t *a = ARENA_OF(prev);
+        int class = get_free_class(prev_w);
+        lock_class(a, class);
+        remove_from_free_list(prev, class);
+        unlock_class(a, class);
+
+        set_block_metadata(prev, prev_w + block_words(hdr) + OVERHEAD_WORDS, false);
+        hdr = prev;
+    }
+
+    return hdr;
 }
 
-// flush some blocks from thread cache back to global free list
-static void flush_thread_cache(int size_class) {
-    thread_cache_t *cache = &thread_caches[size_class];
-    
-    if (cache->count == 0) return;
-    
-    pthread_mutex_lock(&size_class_locks[size_class]);
-    
-    // flush half the cache
-    int flush_count = cache->count / 2;
-    for (int i = 0; i < flush_count; i++) {
-        header *hdr = cache->blocks[--cache->count];
-        hdr->next_offset = ptr_to_offset(free_lists[size_class]);
-        free_lists[size_class] = hdr;
+// free an owned block into the shared lists, merging it with its neighbours
+static void release_block(header *hdr) {
+    set_block_metadata(hdr, block_words(hdr), false);
+    hdr = coalesce(hdr);
+
+    arena_t *a = ARENA_OF(hdr);
+    if (thread_arena && thread_arena->node != a->node) {
+        atomic_fetch_add_explicit(&a->remote_frees, 1, memory_order_relaxed);
     }
-    
-    pthread_mutex_unlock(&size_class_locks[size_class]);
+
+    int class = get_free_class(block_words(hdr));
+    lock_class(a, class);
+    add_to_free_list(hdr);
+    unlock_class(a, class);
 }
 
-void *alloc(int32 bytes) {
-    word words = BYTES_TO_WORDS(bytes);
-    int target_class = get_size_class(words);
+// give objects of a class back to their slabs or, coalescing each block
+// with its free neighbours on the way, to the global free lists
+static void release_objects(int size_class, void **objs, int n) {
+    if (size_class <= SLAB_MAX_CLASS) {
+        slab_return(size_class, objs, n);
+        return;
+    }
 
-    // trying thread-local cache first
-    thread_cache_t *cache = &thread_caches[target_class];
-    if (cache->count > 0) {
-        header *hdr = cache->blocks[--cache->count];
-        hdr->alloced = true;
-        footer *ftr = GET_FOOTER(hdr);
-        ftr->alloced = true;
-        return (void *)((char *)hdr + HEADER_SIZE);
+    for (int i = 0; i < n; i++) {
+        release_block(GET_HEADER(objs[i]));
     }
+}
+
+// objects moved per refill or flush: TRANSFER_BATCH for small classes,
+// fewer for big ones so a batch stays around BATCH_BYTES
+static inline int batch_size(int size_class) {
+    size_t n = BATCH_BYTES / CLASS_BYTES(size_class);
+    if (n < 2) return 2;
+    return n < TRANSFER_BATCH ? (int)n : TRANSFER_BATCH;
+}
+
+// batches a class may park: bounded in count and, for big classes, in bytes
+static int transfer_limit(int size_class) {
+    size_t batch_bytes = CLASS_BYTES(size_class) * batch_size(size_class);
+    size_t limit = TRANSFER_CACHE_BYTES / batch_bytes;
+    if (limit < 1) limit = 1;
+    return limit < TRANSFER_BATCHES ? (int)limit : TRANSFER_BATCHES;
+}
 
-    // cache miss - try to refill from global free lists
-    if (refill_thread_cache(target_class)) {
-        // successfully refilled, try again
-        header *hdr = cache->blocks[--cache->count];
-        hdr->alloced = true;
-        footer *ftr = GET_FOOTER(hdr);
-        ftr->alloced = true;
-        return (void *)((char *)hdr + HEADER_SIZE);
+#ifdef LOCKFREE_LISTS
+#define GENERATION(top) ((((top) >> 32) + 1) << 32)
+
+// park a chain in the transfer cache; false if the class is at its limit
+static bool transfer_push(int size_class, void *chain) {
+    transfer_cache_t *tc = &transfer_caches[size_class];
+
+    // the limit is claimed first, so racing pushes can't overshoot it
+    if (atomic_fetch_add_explicit(&tc->count, 1, memory_order_relaxed) >= transfer_limit(size_class)) {
+        atomic_fetch_sub_explicit(&tc->count, 1, memory_order_relaxed);
+        return false;
     }
 
-    // no blocks available in this size class, try larger size classes
-    for (int i = target_class + 1; i < NUM_SIZE_CLASSES; i++) {
-        pthread_mutex_lock(&size_class_locks[i]);
-
-        header *hdr = free_lists[i];
-        if (hdr) {
-            word hdr_size = hdr->w;
-            remove_from_free_list_checked(hdr);
-
-            // check if we should split
-            if (hdr_size >= words + OVERHEAD_WORDS + 1) {
-                word remainder_size = hdr_size - words - OVERHEAD_WORDS;
-                int remainder_class = get_size_class(remainder_size);
-
-                // only split if remainder stays in same class
-                if (remainder_class == i) {
-                    void *mem = split_block(hdr, words);
-                    pthread_mutex_unlock(&size_class_locks[i]);
-                    return mem;
-                }
-            }
-            
-            // use whole block
-            set_block_metadata(hdr, hdr_size, true);
-            pthread_mutex_unlock(&size_class_locks[i]);
-            return (void *)((char *)hdr + HEADER_SIZE);
+    uint64_t top = atomic_load_explicit(&tc->top, memory_order_relaxed);
+    uint64_t next;
+    do {
+        CHAIN_LINK(chain) = (word)top;
+        next = GENERATION(top) | ptr_to_offset(chain);
+    } while (!atomic_compare_exchange_weak_explicit(&tc->top, &top, next,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    return true;
+}
+
+// the head read by a losing pop may already be handed out and written by
+// its new owner; the value is thrown away when the CAS sees the generation
+// moved, so the race is benign and hidden from ThreadSanitizer
+__attribute__((no_sanitize_thread))
+static word read_link(void *chain) {
+    return ((volatile word *)chain)[1];
+}
+
+static void *transfer_pop(int size_class) {
+    transfer_cache_t *tc = &transfer_caches[size_class];
+
+    uint64_t top = atomic_load_explicit(&tc->top, memory_order_acquire);
+    while ((word)top != 0) {
+        void *chain = offset_to_ptr((word)top);
+        uint64_t next = GENERATION(top) | read_link(chain);
+        if (atomic_compare_exchange_weak_explicit(&tc->top, &top, next,
+                                                  memory_order_acquire,
+                                                  memory_order_acquire)) {
+            atomic_fetch_sub_explicit(&tc->count, 1, memory_order_relaxed);
+            return chain;
         }
+    }
+    return NULL;
+}
+
+static void transfer_reset(transfer_cache_t *tc) {
+    atomic_store(&tc->top, 0);
+    atomic_store(&tc->count, 0);
+}
+#else
+// park a chain in the transfer cache; false if the class is at its limit
+static bool transfer_push(int size_class, void *chain) {
+    transfer_cache_t *tc = &transfer_caches[size_class];
+    bool ok = false;
 
-        pthread_mutex_unlock(&size_class_locks[i]);
+    pthread_mutex_lock(&tc->lock);
+    if (tc->count < transfer_limit(size_class)) {
+        tc->batches[tc->count++] = chain;
+        ok = true;
     }
+    pthread_mutex_unlock(&tc->lock);
 
-    // no suitable free block - allocate from new memory
-    pthread_mutex_lock(&heap_expand_lock);
+    return ok;
+}
+
+static void *transfer_pop(int size_class) {
+    transfer_cache_t *tc = &transfer_caches[size_class];
+    void *chain = NULL;
 
-    header *hdr = heap_top;
+    pthread_mutex_lock(&tc->lock);
+    if (tc->count > 0) chain = tc->batches[--tc->count];
+    pthread_mutex_unlock(&tc->lock);
 
-    if (words > MAXWORDS) {
-        pthread_mutex_unlock(&heap_expand_lock);
-        reterr(err_no_mem);
+    return chain;
+}
+
+static void transfer_reset(transfer_cache_t *tc) {
+    pthread_mutex_lock(&tc->lock);
+    tc->count = 0;
+    pthread_mutex_unlock(&tc->lock);
+}
+#endif
+
+// link objs into a chain, returning its first object
+static void *link_chain(void **objs, int n) {
+    for (int i = 0; i < n - 1; i++) {
+        CHAIN_NEXT(objs[i]) = ptr_to_offset(objs[i + 1]);
     }
+    CHAIN_NEXT(objs[n - 1]) = 0;
+    return objs[0];
+}
 
-    void *mem = allocate_from_fresh_memory(words, hdr);
+// unpack a chain into objs, returning how many it held
+static int unlink_chain(void *chain, void **objs) {
+    int n = 0;
+    while (chain) {
+        objs[n++] = chain;
+        chain = offset_to_ptr(CHAIN_NEXT(chain));
+    }
+    return n;
+}
 
-    // advance heap_top for next allocation
-    footer *ftr = GET_FOOTER(hdr);
-    heap_top = GET_NEXT_HEADER(ftr);
+// drain objects other threads freed into the calling thread's slabs, into
+// its cache where there is room and otherwise back to their slabs
+static void take_remote_frees(bool to_cache) {
+    if (heap_id == 0) return;
 
-    pthread_mutex_unlock(&heap_expand_lock);
-    return mem;
+    thread_heap_t *heap = &thread_heaps[heap_id];
+    if (atomic_load_explicit(&heap->remote, memory_order_relaxed) == 0) return;
+
+    word off = atomic_exchange_explicit(&heap->remote, 0, memory_order_acquire);
+    for (void *obj = offset_to_ptr(off), *next; obj; obj = next) {
+        next = offset_to_ptr(CHAIN_NEXT(obj));
+
+        int class = SLAB_OF(obj)->size_class;
+        thread_cache_t *cache = &thread_caches[class];
+        if (to_cache && cache->count < cache->capacity) {
+            cache->blocks[cache->count] = obj;
+            set_cached(cache, cache->count + 1);
+        } else {
+            slab_return(class, &obj, 1);
+        }
+    }
 }
 
-void dealloc(void *ptr) {
-    if (ptr == NULL) return;
+// push a slab object onto its owner's remote list; false if the owner is gone
+static bool remote_free(word owner, void *ptr) {
+    thread_heap_t *heap = &thread_heaps[owner];
+    if (!atomic_load(&heap->alive)) return false;
+
+    word off = ptr_to_offset(ptr);
+    word head = atomic_load_explicit(&heap->remote, memory_order_relaxed);
+    do {
+        CHAIN_NEXT(ptr) = head;
+    } while (!atomic_compare_exchange_weak(&heap->remote, &head, off));
+
+    // the owner may have exited and drained for the last time in between;
+    // then whatever is on the list goes straight back to the slabs
+    if (!atomic_load(&heap->alive)) {
+        off = atomic_exchange(&heap->remote, 0);
+        for (void *obj = offset_to_ptr(off), *next; obj; obj = next) {
+            next = offset_to_ptr(CHAIN_NEXT(obj));
+            slab_return(SLAB_OF(obj)->size_class, &obj, 1);
+        }
+    }
+    return true;
+}
 
-    header *hdr = (header *)((char *)ptr - HEADER_SIZE);
-    word size = hdr->w;
-    int size_class = get_size_class(size);
+// hand every parked batch back to the slabs and free lists, so blocks that
+// went idle in the transfer cache can be coalesced and purged
+static void drain_transfer_caches(void) {
+    void *objs[TRANSFER_BATCH];
 
-    // mark as free
-    hdr->alloced = false;
-    footer *ftr = GET_FOOTER(hdr);
-    ftr->alloced = false;
+    for (int i = 0; i < TOP_CLASS; i++) {
+        void *chain;
+        while ((chain = transfer_pop(i)) != NULL) {
+            int n = unlink_chain(chain, objs);
+            atomic_fetch_sub_explicit(&transfer_objects[i], n, memory_order_relaxed);
+            release_objects(i, objs, n);
+        }
+    }
+}
 
-    // return to thread-local cache (lockless)
-    thread_cache_t *cache = &thread_caches[size_class];
-    if (cache->count < THREAD_CACHE_SIZE) {
-        cache->blocks[cache->count++] = hdr;
-        return;
+// madvise away the pages of free blocks that have been idle for the decay
+// time, or of every free block if `all` is set; parked batches are handed
+// back first, so nothing idles in the transfer cache past one pass
+static void purge_free_lists(bool all) {
+    drain_transfer_caches();
+
+    word now = now_ms();
+    word decay = (word)atomic_load_explicit(&decay_ms, memory_order_relaxed);
+
+    // only the classes that can hold a block spanning a whole page
+    int first = get_free_class(BYTES_TO_WORDS(heap_page_size));
+
+    // every arena, including any left over from a larger arena count
+    for (int n = 0; n < MAX_ARENAS; n++) {
+        arena_t *a = &arenas[n];
+        uint64_t bits = atomic_load_explicit(&a->free_list_bits, memory_order_relaxed);
+        if ((bits >> first) == 0) continue;
+
+        for (int i = first; i < NUM_SIZE_CLASSES; i++) {
+            pthread_mutex_lock(&a->locks[i]);
+
+            header *hdr = a->free_lists[i];
+            for (; hdr; hdr = offset_to_ptr(GET_FREE_PAYLOAD(hdr)->next_offset)) {
+                word w = block_words(hdr);
+                if (WORDS_TO_BYTES(w) <= heap_page_size) continue;
+
+                free_payload *fp = GET_PAYLOAD(hdr);
+                if (fp->freed_at == 0) continue;
+                if (!all && now - fp->freed_at < decay) continue;
+
+                heap_purge(fp + 1, WORDS_TO_BYTES(w) - sizeof(free_payload));
+                fp->freed_at = 0;
+            }
+
+            pthread_mutex_unlock(&a->locks[i]);
+        }
     }
 
-    // cache full - flush half to global list, then add this block
-    flush_thread_cache(size_class);
-    cache->blocks[cache->count++] = hdr;
+    slab_purge(now, decay, all);
 }
 
-void show(header *hdr) {
-    if (hdr == NULL) return;
+// run a purge pass if half the decay time has passed since the last one;
+// called from slow paths so the clock read is amortized over many frees
+static void maybe_purge(void) {
+    long decay = atomic_load_explicit(&decay_ms, memory_order_relaxed);
+    if (decay < 0) return;
 
-    header *p = hdr;
-    int32 n = 1;
+    word now = now_ms();
+    word next = atomic_load_explicit(&next_purge_ms, memory_order_relaxed);
+    if (next != 0 && (int)(now - next) < 0) return;
 
-    while (p->w != 0) {
-        printf("Block %d: %u words, %s at %p\n",
-               n, p->w,
-               p->alloced ? "allocated" : "free",
-               (void *)p);
+    // someone else is already purging
+    if (pthread_mutex_trylock(&purge_lock) != 0) return;
 
-        footer *ftr = GET_FOOTER(p);
-        p = GET_NEXT_HEADER(ftr);
-        n++;
+    atomic_store_explicit(&next_purge_ms, now + (word)(decay / 2) + 1,
+                          memory_order_relaxed);
+    purge_free_lists(false);
+
+    pthread_mutex_unlock(&purge_lock);
+}
+
+// hand out a block already removed from its free list, splitting off the
+// rest when it is big enough to be a block of its own
+static void *take_block(header *hdr, word words) {
+    word hdr_size = block_words(hdr);
+
+    // check if we should split
+    if (hdr_size >= words + OVERHEAD_WORDS + MIN_BLOCK_WORDS) {
+        return split_block(hdr, words);
+    }
+
+    // use whole block
+    set_block_metadata(hdr, hdr_size, true);
+    return (void *)((char *)hdr + HEADER_SIZE);
+}
+
+// smallest block handed to a caller outside alloc(); anything smaller would
+// be freed into the cache of a slab class
+#define MIN_OWNED_WORDS SIZE_CLASS_LIMITS[SLAB_MAX_CLASS + 1]
+
+// cut an owned allocated block down to `words`, freeing the tail when it is
+// big enough to be a block of its own; the tail merges with a free successor
+static void trim_block(header *hdr, word words) {
+    word w = block_words(hdr);
+    if (w < words + OVERHEAD_WORDS + MIN_BLOCK_WORDS) return;
+
+    set_block_metadata(hdr, words, true);
+    header *rest = GET_NEXT_HEADER(hdr);
+    init_block_metadata(rest, w - words - OVERHEAD_WORDS, false);
+    release_block(rest);
+}
+
+// resize an owned allocated block without moving it: shrink by trimming,
+// grow into the rest of the caller's span or into a free successor.
+// returns false if the block has to move
+static bool resize_block(header *hdr, word words) {
+    word w = block_words(hdr);
+    if (words <= w) {
+        trim_block(hdr, words);
+        return true;
+    }
+
+    header *next = GET_NEXT_HEADER(hdr);
+
+    // the last block carved from the span can take more of it
+    if ((char *)next == span_top) {
+        size_t extra = WORDS_TO_BYTES((size_t)(words - w));
+        if (span_end - span_top < (ptrdiff_t)extra) return false;
+
+        size_t left = span_end - span_top - extra;
+        if (left < MIN_BLOCK_BYTES) extra += left;
+        span_top += extra;
+        set_block_metadata(hdr, w + extra / sizeof(word), true);
+        return true;
+    }
+
+    if (w + OVERHEAD_WORDS + block_words(next) < words || !claim_next(next)) return false;
+
+    // the successor may have grown between the peek and the claim
+    set_block_metadata(hdr, w + block_words(next) + OVERHEAD_WORDS, true);
+    trim_block(hdr, words);
+    return true;
+}
+
+// a miss means the cache is smaller than the thread's working set, so it
+// grows by a batch as long as the global budget has room
+static void grow_thread_cache(int size_class) {
+    thread_cache_t *cache = &thread_caches[size_class];
+    int batch = batch_size(size_class);
+
+    if (cache->capacity == 0) {
+        cache->capacity = batch;
+        return;
+    }
+    if (cache->capacity + batch > THREAD_CACHE_SIZE) return;
+
+    size_t bytes = CLASS_BYTES(size_class) * batch;
+    if (atomic_fetch_add_explicit(&cache_budget_used, bytes, memory_order_relaxed) + bytes >
+        THREAD_CACHE_BUDGET) {
+        atomic_fetch_sub_explicit(&cache_budget_used, bytes, memory_order_relaxed);
+        return;
     }
+    cache->capacity += batch;
+    cache->overflows = 0;
 }
 
-void init_allocator(void) {
-    heap_top = (header *)memspace;
+// frees keep outrunning allocations (a consumer thread, say), so give a
+// batch of capacity back to the budget
+static void shrink_thread_cache(int size_class) {
+    thread_cache_t *cache = &thread_caches[size_class];
+    int batch = batch_size(size_class);
 
-    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
-        free_lists[i] = NULL;
+    if (cache->capacity > batch) {
+        cache->capacity -= batch;
+        atomic_fetch_sub_explicit(&cache_budget_used, CLASS_BYTES(size_class) * batch,
+                                  memory_order_relaxed);
     }
-    
-    // Thread-local caches are initialized automatically to zero
+    cache->overflows = 0;
+}
+
+// fill objs with up to one batch from the transfer cache, or else from the
+// class's slabs (taken for thread heap `owner`) or the free list of the
+// caller's arena; returns how many it got, 0 if that list is empty
+static int fetch_batch(int size_class, void **objs, word owner) {
+    arena_t *a = my_arena();
+    int n = 0;
+
+    void *chain = transfer_pop(size_class);
+    if (chain) {
+        n = unlink_chain(chain, objs);
+        atomic_fetch_sub_explicit(&transfer_objects[size_class], n, memory_order_relaxed);
+        return n;
+    }
+
+    if (size_class <= SLAB_MAX_CLASS) {
+        return slab_take(size_class, objs, batch_size(size_class), owner);
+    }
+
+    lock_class(a, size_class);
+    
+    for (int i = 0; i < batch_size(size_class); i++) {
+        header *hdr = take_listed(a, size_class);
+        if (hdr == NULL) break;
+        
+        objs[n++] = GET_PAYLOAD(hdr);
+    }
+    
+    unlock_class(a, size_class);
+    
+    return n;
+}
+
+// park objs as one batch in the transfer cache, or send them straight back
+// to the slabs and free lists if that is full
+static void release_chain(int size_class, void **objs, int n) {
+    // link the batch up front so parking it is a single store
+    if (transfer_push(size_class, link_chain(objs, n))) {
+        atomic_fetch_add_explicit(&transfer_objects[size_class], n, memory_order_relaxed);
+    } else {
+        release_objects(size_class, objs, n);
+    }
+}
+
+// refill thread cache from remote frees or fetch_batch(); returns true if
+// successful, false if global list is empty
+static bool refill_thread_cache(int size_class) {
+    thread_cache_t *cache = &thread_caches[size_class];
+
+    register_thread();
+    grow_thread_cache(size_class);
+
+    // objects other threads gave back come first
+    take_remote_frees(true);
+    if (cache->count > 0) return true;
+
+    int n = fetch_batch(size_class, &cache->blocks[cache->count], heap_id);
+    if (n > 0) STAT(size_class, refills, 1);
+    set_cached(cache, cache->count + n);
+    return cache->count > 0;
+}
+
+// move the newest `n` cached objects as one batch to the transfer cache
+static void release_batch(int size_class, int n) {
+    thread_cache_t *cache = &thread_caches[size_class];
+
+    set_cached(cache, cache->count - n);
+    release_chain(size_class, &cache->blocks[cache->count], n);
+    STAT(size_class, flushes, 1);
+}
+
+// a free found the cache full: shrink it if that keeps happening, then
+// flush batches until there is room again
+static void flush_thread_cache(int size_class) {
+    thread_cache_t *cache = &thread_caches[size_class];
+    int batch = batch_size(size_class);
+    LATENCY_PATH(LATENCY_FLUSH);
+
+    register_thread();
+    if (cache->capacity == 0) {
+        cache->capacity = batch;
+        return;
+    }
+
+    if (++cache->overflows > THREAD_CACHE_OVERFLOWS) {
+        shrink_thread_cache(size_class);
+    }
+    while (cache->count >= cache->capacity) {
+        release_batch(size_class, batch);
+    }
+    maybe_purge();
+}
+
+// per-CPU caches hold up to two batches, so a refill followed by a flush
+// doesn't bounce the same batch back and forth
+static inline int percpu_capacity(int size_class) {
+    int cap = 2 * batch_size(size_class);
+    return cap < PERCPU_CACHE_SIZE ? cap : PERCPU_CACHE_SIZE;
+}
+
+// pop from the current CPU's cache, refilling it with a batch when empty;
+// returns false if the thread has no rseq area, otherwise *mem is the
+// object or NULL when the heap is exhausted
+static bool percpu_alloc(int size_class, void **mem) {
+    for (;;) {
+        int cpu = percpu_cpu();
+        if (cpu < 0) return false;
+
+        int status = percpu_pop(cpu, size_class, mem);
+        if (status == PERCPU_OK) {
+            STAT(size_class, cache_hits, 1);
+            return true;
+        }
+        if (status == PERCPU_EMPTY) break;
+    }
+    STAT(size_class, cache_misses, 1);
+    LATENCY_PATH(LATENCY_REFILL);
+
+    // per-CPU objects have no owning thread, so their slabs take no remote frees
+    void *objs[TRANSFER_BATCH];
+    int n = fetch_batch(size_class, objs, 0);
+    if (n > 0) STAT(size_class, refills, 1);
+    *mem = n > 0 ? objs[--n] : NULL;
+
+    // the thread may have moved since, so stash the rest wherever it is now
+    int i = 0;
+    while (i < n) {
+        int cpu = percpu_cpu();
+        if (cpu < 0) break;
+        int status = percpu_push(cpu, size_class, objs[i], percpu_capacity(size_class));
+        if (status == PERCPU_OK) i++;
+        else if (status == PERCPU_FULL) break;
+    }
+    if (i < n) release_objects(size_class, &objs[i], n - i);
+
+    return true;
+}
+
+// push onto the current CPU's cache, moving a batch out to the transfer
+// cache first when it is full; false if the thread has no rseq area
+static bool percpu_free(int size_class, void *ptr) {
+    int cap = percpu_capacity(size_class);
+
+    for (;;) {
+        int cpu = percpu_cpu();
+        if (cpu < 0) return false;
+
+        int status = percpu_push(cpu, size_class, ptr, cap);
+        if (status == PERCPU_OK) return true;
+        if (status == PERCPU_ABORTED) continue;
+
+        LATENCY_PATH(LATENCY_FLUSH);
+        void *objs[TRANSFER_BATCH];
+        int n = 0;
+        while (n < batch_size(size_class)) {
+            status = percpu_pop(cpu, size_class, &objs[n]);
+            if (status == PERCPU_OK) n++;
+            else if (status == PERCPU_EMPTY || percpu_cpu() != cpu) break;
+        }
+        if (n > 0) {
+            release_chain(size_class, objs, n);
+            STAT(size_class, flushes, 1);
+        }
+        maybe_purge();
+    }
+}
+
+// hand every per-CPU cached object back (assumes no thread is using them)
+static void percpu_drain(void) {
+    void *objs[PERCPU_CACHE_SIZE];
+
+    for (int cpu = 0; cpu < percpu_count(); cpu++) {
+        for (int i = 0; i < TOP_CLASS; i++) {
+            int n = percpu_take_all(cpu, i, objs);
+            release_objects(i, objs, n);
+        }
+    }
+}
+
+// free what is left of the calling thread's span; spans never end in a
+// sliver too small to be a block, so the rest is either empty or a block
+static void retire_span(void) {
+    if (span_end - span_top >= (ptrdiff_t)MIN_BLOCK_BYTES) {
+        header *hdr = (header *)span_top;
+        set_block_metadata(hdr, BYTES_TO_WORDS(span_end - span_top - OVERHEAD), false);
+        release_block(hdr);
+    }
+    span_top = span_end = NULL;
+}
+
+// claim the next span of the current segment of the caller's arena; the
+// last span of a segment takes whatever is left so no sliver remains.
+// only mapping a new segment takes the arena's expand_lock
+static bool claim_span(void) {
+    register_thread();
+    arena_t *a = my_arena();
+    uint64_t cur = atomic_load_explicit(&a->top, memory_order_acquire);
+
+    for (;;) {
+        char *top = (char *)offset_to_ptr((word)cur);
+        char *end = (char *)offset_to_ptr((word)(cur >> 32));
+        size_t left = end - top;
+
+        if (left > 0) {
+            size_t take = left < SPAN_SIZE + MIN_BLOCK_BYTES ? left : SPAN_SIZE;
+            uint64_t next = cur + take / sizeof(word);
+            if (atomic_compare_exchange_weak_explicit(&a->top, &cur, next,
+                                                      memory_order_acquire,
+                                                      memory_order_acquire)) {
+                span_top = top;
+                span_end = top + take;
+                return true;
+            }
+            continue;
+        }
+
+        // segment used up: whoever gets the lock first maps the next one
+        pthread_mutex_lock(&a->expand_lock);
+        bool ok = atomic_load_explicit(&a->top, memory_order_acquire) != cur || grow_heap(a);
+        pthread_mutex_unlock(&a->expand_lock);
+        if (!ok) return false;
+
+        cur = atomic_load_explicit(&a->top, memory_order_acquire);
+    }
+}
+
+// carve a block off the calling thread's span, claiming a new span if it
+// doesn't fit
+static void *alloc_from_heap_top(word words) {
+    LATENCY_PATH(LATENCY_FRESH);
+    size_t needed = WORDS_TO_BYTES((size_t)words) + OVERHEAD;
+    if (needed > SPAN_SIZE) reterr(err_no_mem);
+
+    while (span_end - span_top < (ptrdiff_t)needed) {
+        retire_span();
+        if (!claim_span()) reterr(err_no_mem);
+    }
+
+    // a tail too small to hold a block goes to this one
+    size_t left = span_end - span_top - needed;
+    if (left < MIN_BLOCK_BYTES) {
+        words += left / sizeof(word);
+        needed += left;
+    }
+
+    header *hdr = (header *)span_top;
+    span_top += needed;
+    fresh_memory = true;
+    return allocate_from_fresh_memory(words, hdr);
+}
+
+// large objects get their own mapping outside the segmented heap
+static void *alloc_large(int32 bytes) {
+    LATENCY_PATH(LATENCY_LARGE);
+    size_t size = sizeof(large_header) + bytes;
+    size = (size + heap_page_size - 1) & ~(heap_page_size - 1);
+
+    large_header *lh = heap_map_large(size);
+    if (lh == NULL) reterr(err_no_mem);
+
+    lh->size = size;
+    lh->offset = 0;
+    lh->sampled = 0;
+    fresh_memory = true;
+    count_alloc(STATS_LARGE, size - sizeof(large_header));
+    return (void *)(lh + 1);
+}
+
+// over-map by the alignment and put the header right before the first
+// aligned payload address
+static void *alloc_large_aligned(size_t align, size_t bytes) {
+    LATENCY_PATH(LATENCY_LARGE);
+    size_t size = sizeof(large_header) + bytes + align;
+    size = (size + heap_page_size - 1) & ~(heap_page_size - 1);
+
+    char *base = heap_map_large(size);
+    if (base == NULL) reterr(err_no_mem);
+
+    uintptr_t payload = ((uintptr_t)base + sizeof(large_header) + align - 1) & ~(align - 1);
+    large_header *lh = (large_header *)payload - 1;
+    lh->size = size;
+    lh->offset = (char *)lh - base;
+    lh->sampled = 0;
+    count_alloc(STATS_LARGE, size - lh->offset - sizeof(large_header));
+    return (void *)payload;
+}
+
+static void dealloc_large(void *ptr) {
+    LATENCY_PATH(LATENCY_LARGE);
+    large_header *lh = (large_header *)ptr - 1;
+    if (lh->sampled) profile_release(lh->stack, lh->sampled);
+    count_free(STATS_LARGE, lh->size - lh->offset - sizeof(large_header));
+    heap_unmap_large((char *)lh - lh->offset, lh->size);
+}
+
+// the top class holds blocks of any size above the class below it, so it is
+// searched first-fit under its lock instead of going through thread caches
+static void *alloc_from_top_class(word words) {
+    arena_t *a = my_arena();
+    lock_class(a, TOP_CLASS);
+
+    header *hdr = a->free_lists[TOP_CLASS];
+    while (hdr && (block_words(hdr) < words || !claim_listed(hdr))) {
+        hdr = offset_to_ptr(GET_FREE_PAYLOAD(hdr)->next_offset);
+    }
+    if (hdr) remove_from_free_list(hdr, TOP_CLASS);
+
+    unlock_class(a, TOP_CLASS);
+    return hdr ? take_block(hdr, words) : NULL;
+}
+
+// take the first block from the lowest populated class at or above
+// `first_class` in the caller's arena, falling back to new memory
+static void *alloc_from_free_lists(word words, int first_class) {
+    arena_t *a = my_arena();
+    uint64_t candidates = atomic_load_explicit(&a->free_list_bits, memory_order_relaxed) &
+                          ~((1ull << first_class) - 1);
+    while (candidates) {
+        int i = __builtin_ctzll(candidates);
+        candidates &= candidates - 1;
+
+        lock_class(a, i);
+        header *hdr = take_listed(a, i);
+        unlock_class(a, i);
+
+        if (hdr) return take_block(hdr, words);
+    }
+
+    // no suitable free block - allocate from new memory
+    return alloc_from_heap_top(words);
+}
+
+// take a block of at least `words` straight from the caller's arena,
+// bypassing the caches
+static void *alloc_block(word words) {
+    words = BLOCK_WORDS(words);
+    int class = get_size_class(words);
+    if (class != TOP_CLASS) return alloc_from_free_lists(words, class);
+
+    void *mem = alloc_from_top_class(words);
+    return mem ? mem : alloc_from_heap_top(words);
+}
+
+// count an allocation served from the block segments; its usable size is
+// that of the block it got
+static inline void *count_block_alloc(int size_class, void *mem) {
+    if (mem) count_alloc(size_class, WORDS_TO_BYTES((size_t)block_words(GET_HEADER(mem))));
+    return mem;
+}
+
+// hand out an object taken from a cache of its class
+static inline void *cached_object(int size_class, void *mem) {
+    if (size_class <= SLAB_MAX_CLASS) {
+        count_slab_alloc(size_class);
+        return mem;
+    }
+    set_block_alloced(GET_HEADER(mem), true);
+    return count_block_alloc(size_class, mem);
+}
+
+// a sampled object is mapped like a large one, so telling it apart on free
+// costs only the frees that take the large path; the stack recorded starts
+// at alloc()'s caller
+__attribute__((noinline))
+static void *alloc_sampled(int32 bytes) {
+    word id = profile_record(bytes, 3);
+    if (id == 0) return NULL;
+
+    void *mem = alloc_large(bytes);
+    if (mem == NULL) {
+        profile_release(id, bytes);
+        return NULL;
+    }
+
+    large_header *lh = (large_header *)mem - 1;
+    lh->sampled = bytes;
+    lh->stack = id;
+    return mem;
+}
+
+static inline void *alloc_object(int32 bytes) {
+    if (bytes > LARGE_THRESHOLD) {
+        return alloc_large(bytes);
+    }
+
+    word words = BYTES_TO_WORDS(bytes);
+    int target_class = get_size_class(words);
+
+    if (target_class != TOP_CLASS) {
+        // round up so the block can be reused by any request in its class
+        words = BLOCK_WORDS(SIZE_CLASS_LIMITS[target_class]);
+    } else {
+        words = BLOCK_WORDS(words);
+        LATENCY_PATH(LATENCY_TOP);
+        void *mem = alloc_from_top_class(words);
+        return count_block_alloc(TOP_CLASS, mem ? mem : alloc_from_heap_top(words));
+    }
+
+    if (thread_cache_disabled) {
+        LATENCY_PATH(LATENCY_UNCACHED);
+        if (target_class <= SLAB_MAX_CLASS) {
+            void *mem;
+            if (slab_take(target_class, &mem, 1, 0) == 0) reterr(err_no_mem);
+            count_slab_alloc(target_class);
+            return mem;
+        }
+        return count_block_alloc(target_class, alloc_from_free_lists(words, target_class));
+    }
+
+    void *mem;
+    if (atomic_load_explicit(&percpu_enabled, memory_order_relaxed) &&
+        percpu_alloc(target_class, &mem)) {
+        if (mem == NULL) {
+            if (target_class <= SLAB_MAX_CLASS) reterr(err_no_mem);
+            LATENCY_PATH(LATENCY_SPLIT);
+            return count_block_alloc(target_class, alloc_from_free_lists(words, target_class + 1));
+        }
+        return cached_object(target_class, mem);
+    }
+
+    // trying thread-local cache first, refilling it on a miss
+    thread_cache_t *cache = &thread_caches[target_class];
+    if (cache->count > 0) {
+        STAT(target_class, cache_hits, 1);
+    } else {
+        STAT(target_class, cache_misses, 1);
+        LATENCY_PATH(LATENCY_REFILL);
+    }
+    if (cache->count > 0 || refill_thread_cache(target_class)) {
+        set_cached(cache, cache->count - 1);
+        return cached_object(target_class, cache->blocks[cache->count]);
+    }
+
+    // slabs only run dry when the reservation is used up
+    if (target_class <= SLAB_MAX_CLASS) reterr(err_no_mem);
+
+    // no blocks available in this size class, try larger size classes
+    LATENCY_PATH(LATENCY_SPLIT);
+    return count_block_alloc(target_class, alloc_from_free_lists(words, target_class + 1));
+}
+
+void *alloc(int32 bytes) {
+    LATENCY_START(LATENCY_HIT);
+
+    void *mem = NULL;
+    if (__builtin_expect((profile_countdown -= bytes) < 0, 0) && profile_due()) {
+        mem = alloc_sampled(bytes);
+    }
+    if (mem == NULL) mem = alloc_object(bytes);
+
+    LATENCY_END();
+    return mem;
+}
+
+// hand a freed object to the per-CPU cache, or else the thread cache, of its class
+static inline void cache_object(int size_class, void *ptr, bool percpu) {
+    if (percpu && percpu_free(size_class, ptr)) return;
+
+    // return to thread-local cache (lockless)
+    thread_cache_t *cache = &thread_caches[size_class];
+    if (cache->count < cache->capacity) {
+        cache->blocks[cache->count] = ptr;
+        set_cached(cache, cache->count + 1);
+        return;
+    }
+
+    // cache full - flush to the transfer cache, then add this block
+    flush_thread_cache(size_class);
+    cache->blocks[cache->count] = ptr;
+    set_cached(cache, cache->count + 1);
+}
+
+static inline void free_object(void *ptr) {
+    if (ptr == NULL) return;
+
+    if (!in_heap(ptr)) {
+        dealloc_large(ptr);
+        return;
+    }
+
+    bool percpu = atomic_load_explicit(&percpu_enabled, memory_order_relaxed);
+    int size_class;
+    if (SEGMENT_KIND(ptr) == SEGMENT_SLABS) {
+        slab_t *slab = SLAB_OF(ptr);
+        size_class = slab->size_class;
+        count_slab_free(size_class);
+
+        if (thread_cache_disabled) {
+            slab_return(size_class, &ptr, 1);
+            maybe_purge();
+            return;
+        }
+
+        // another thread allocates from this slab: send the object back
+        word owner = __atomic_load_n(&slab->owner, __ATOMIC_RELAXED);
+        if (!percpu && owner != 0 && owner != heap_id && remote_free(owner, ptr)) return;
+    } else {
+        header *hdr = GET_HEADER(ptr);
+        word words = block_words(hdr);
+        size_class = get_free_class(words);
+        count_free(size_class, WORDS_TO_BYTES((size_t)words));
+
+        // top class blocks skip the cache and go straight back to the shared list
+        if (size_class == TOP_CLASS || thread_cache_disabled) {
+            release_block(hdr);
+            maybe_purge();
+            return;
+        }
+
+        set_block_alloced(hdr, false);
+    }
+
+    cache_object(size_class, ptr, percpu);
+}
+
+void dealloc(void *ptr) {
+    LATENCY_START(LATENCY_FREE);
+    free_object(ptr);
+    LATENCY_END();
+}
+
+// free an object of `bytes`, the size it was allocated (or last
+// reallocated) with. for slab objects the class comes from the size, so
+// the cache slot is known without reading the segment kind or the slab
+// header first; only the owner check still loads from the slab. blocks
+// have their header updated on free anyway and take the usual path
+static inline void free_sized_object(void *ptr, size_t bytes) {
+    if (ptr == NULL) return;
+
+    // sampled objects of any size live in mappings of their own
+    if (!in_heap(ptr)) {
+        free_object(ptr);
+        return;
+    }
+
+    int size_class = bytes > LARGE_THRESHOLD ? TOP_CLASS
+                                             : get_size_class(BYTES_TO_WORDS(bytes));
+    if (size_class > SLAB_MAX_CLASS || thread_cache_disabled) {
+        free_object(ptr);
+        return;
+    }
+
+    // a wrong size would file the object under another class's cache
+    assert(SEGMENT_KIND(ptr) == SEGMENT_SLABS &&
+           SLAB_OF(ptr)->size_class == (word)size_class);
+    count_slab_free(size_class);
+
+    bool percpu = atomic_load_explicit(&percpu_enabled, memory_order_relaxed);
+    if (!percpu) {
+        word owner = __atomic_load_n(&SLAB_OF(ptr)->owner, __ATOMIC_RELAXED);
+        if (owner != 0 && owner != heap_id && remote_free(owner, ptr)) return;
+    }
+
+    cache_object(size_class, ptr, percpu);
+}
+
+void dealloc_sized(void *ptr, size_t bytes) {
+    LATENCY_START(LATENCY_FREE);
+    free_sized_object(ptr, bytes);
+    LATENCY_END();
+}
+
+// bytes the caller may use at ptr, at least what it asked for
+size_t alloc_usable_size(void *ptr) {
+    if (ptr == NULL) return 0;
+
+    if (!in_heap(ptr)) {
+        large_header *lh = (large_header *)ptr - 1;
+        return lh->size - lh->offset - sizeof(large_header);
+    }
+    if (SEGMENT_KIND(ptr) == SEGMENT_SLABS) {
+        return CLASS_BYTES(SLAB_OF(ptr)->size_class);
+    }
+    return WORDS_TO_BYTES((size_t)block_words(GET_HEADER(ptr)));
+}
+
+// an object resized in place counts as freed at its old size and
+// allocated again at the new one
+static inline void count_resize(int size_class, size_t old_bytes, size_t new_bytes) {
+    count_free(size_class, old_bytes);
+    count_alloc(size_class, new_bytes);
+}
+
+// resize in place where the memory after the object allows, otherwise move
+void *alloc_realloc(void *ptr, size_t bytes) {
+    if (bytes > UINT32_MAX) reterr(err_no_mem);
+    if (ptr == NULL) return alloc((int32)bytes);
+    if (bytes == 0) {
+        dealloc(ptr);
+        return NULL;
+    }
+
+    word words = BYTES_TO_WORDS(bytes);
+    int class = get_size_class(words);
+
+    if (!in_heap(ptr)) {
+        // large objects stay mapped and are grown or shrunk with mremap
+        large_header *lh = (large_header *)ptr - 1;
+        if (bytes > LARGE_THRESHOLD && lh->offset == 0 && lh->sampled == 0) {
+            size_t size = sizeof(large_header) + bytes;
+            size = (size + heap_page_size - 1) & ~(heap_page_size - 1);
+            if (size == lh->size) return ptr;
+
+            size_t old_size = lh->size;
+            lh = heap_remap_large(lh, old_size, size);
+            if (lh) {
+                lh->size = size;
+                count_resize(STATS_LARGE, old_size - sizeof(large_header),
+                             size - sizeof(large_header));
+                return (void *)(lh + 1);
+            }
+        }
+    } else if (SEGMENT_KIND(ptr) == SEGMENT_SLABS) {
+        if (class == (int)SLAB_OF(ptr)->size_class) return ptr;
+    } else if (bytes <= LARGE_THRESHOLD && class > SLAB_MAX_CLASS) {
+        word target = BLOCK_WORDS(class == TOP_CLASS ? words : SIZE_CLASS_LIMITS[class]);
+        header *hdr = GET_HEADER(ptr);
+        word old = block_words(hdr);
+        if (resize_block(hdr, target)) {
+            count_resize(get_free_class(old), WORDS_TO_BYTES((size_t)old),
+                         WORDS_TO_BYTES((size_t)block_words(hdr)));
+            return ptr;
+        }
+    }
+
+    void *mem = alloc((int32)bytes);
+    if (mem == NULL) return NULL;
+
+    size_t old = alloc_usable_size(ptr);
+    memcpy(mem, ptr, old < bytes ? old : bytes);
+    dealloc(ptr);
+    return mem;
+}
+
+// zeroed memory; blocks carved from never touched memory and large
+// mappings are zero already
+void *alloc_calloc(size_t n, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(n, size, &bytes) || bytes > UINT32_MAX) reterr(err_no_mem);
+
+    fresh_memory = false;
+    void *mem = alloc((int32)bytes);
+    if (mem && !fresh_memory) memset(mem, 0, bytes);
+    return mem;
+}
+
+// memory aligned to `align`, a power of two; a block is taken with room for
+// the alignment and the part before the aligned address is freed as a
+// block of its own rather than wasted
+void *alloc_aligned(size_t align, size_t bytes) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (bytes > UINT32_MAX) reterr(err_no_mem);
+
+    // sizes rounded to ALLOC_ALIGN are placed aligned to it
+    if (align <= ALLOC_ALIGN) {
+        bytes = (bytes + ALLOC_ALIGN - 1) & ~(size_t)(ALLOC_ALIGN - 1);
+        if (bytes > UINT32_MAX) reterr(err_no_mem);
+        return alloc((int32)bytes);
+    }
+
+    // often the natural placement is aligned enough
+    void *mem = alloc((int32)bytes);
+    if (mem == NULL || ((uintptr_t)mem & (align - 1)) == 0) return mem;
+    dealloc(mem);
+
+    // a gap before the aligned payload must hold a whole free block
+    size_t pad = align + MIN_BLOCK_BYTES;
+    if (bytes + pad > LARGE_THRESHOLD) return alloc_large_aligned(align, bytes);
+
+    word words = BYTES_TO_WORDS(bytes);
+    if (words < MIN_OWNED_WORDS) words = MIN_OWNED_WORDS;
+    words = BLOCK_WORDS(words);
+
+    char *p = alloc_block(words + BYTES_TO_WORDS(pad));
+    if (p == NULL) return NULL;
+
+    header *hdr = GET_HEADER(p);
+    if (((uintptr_t)p & (align - 1)) != 0) {
+        char *q = (char *)(((uintptr_t)p + MIN_BLOCK_BYTES + align - 1) & ~(align - 1));
+        char *end = p + WORDS_TO_BYTES((size_t)block_words(hdr));
+
+        header *aligned = GET_HEADER(q);
+        init_block_metadata(aligned, BYTES_TO_WORDS(end - q), true);
+        set_block_metadata(hdr, BYTES_TO_WORDS(q - p - OVERHEAD), false);
+        release_block(hdr);
+        hdr = aligned;
+        p = q;
+    }
+
+    trim_block(hdr, words);
+    return count_block_alloc(get_free_class(block_words(hdr)), p);
+}
+
+int alloc_posix_memalign(void **out, size_t align, size_t bytes) {
+    if (align == 0 || align % sizeof(void *) != 0 || (align & (align - 1)) != 0) return EINVAL;
+
+    void *mem = alloc_aligned(align, bytes);
+    if (mem == NULL) return ENOMEM;
+    *out = mem;
+    return 0;
+}
+
+void show(header *hdr) {
+    if (hdr == NULL) return;
+
+    header *p = hdr;
+    int32 n = 1;
+
+    while (block_words(p) != 0) {
+        printf("Block %d: %u words, %s at %p\n",
+               n, block_words(p),
+               block_alloced(p) ? "allocated" : "free",
+               (void *)p);
+
+        p = GET_NEXT_HEADER(p);
+        n++;
+    }
+}
+
+// empty every class of the calling thread's cache into the shared lists
+// and return its capacity to the budget
+static void release_thread_cache(void) {
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        thread_cache_t *cache = &thread_caches[i];
+        release_objects(i, cache->blocks, cache->count);
+
+        int batch = batch_size(i);
+        if (cache->capacity > batch) {
+            atomic_fetch_sub_explicit(&cache_budget_used,
+                                      CLASS_BYTES(i) * (cache->capacity - batch),
+                                      memory_order_relaxed);
+        }
+        set_cached(cache, 0);
+        cache->capacity = cache->overflows = 0;
+    }
+}
+
+int alloc_set_arenas(int count, int assign) {
+    if (count < 0 || count > MAX_ARENAS) return EINVAL;
+    if (assign != ARENA_ROUND_ROBIN && assign != ARENA_BY_CPU) return EINVAL;
+
+    atomic_store(&arena_assign, assign);
+    atomic_store(&num_arenas, count);
+    arena_count();
+    thread_arena = NULL;
+    return 0;
+}
+
+int alloc_set_numa(bool enabled) {
+    pthread_once(&numa_once, numa_setup);
+    if (enabled && heap_numa_nodes() == 0) return ENOSYS;
+
+    atomic_store(&numa_enabled, enabled);
+    thread_arena = NULL;
+    return 0;
+}
+
+int alloc_numa_nodes(void) {
+    pthread_once(&numa_once, numa_setup);
+    return num_nodes;
+}
+
+int alloc_node_stats(int node, alloc_node_stats_t *stats) {
+    pthread_once(&numa_once, numa_setup);
+    if (node < 0 || node >= num_nodes) return EINVAL;
+
+    memset(stats, 0, sizeof(*stats));
+    int n = arena_count();
+    for (int i = 0; i < MAX_ARENAS; i++) {
+        if (arenas[i].node != node) continue;
+        stats->mapped += atomic_load(&arenas[i].mapped);
+        stats->remote_frees += atomic_load(&arenas[i].remote_frees);
+        if (i < n) stats->arenas++;
+    }
+    return 0;
+}
+
+void alloc_thread_stats(alloc_stats_t *stats) {
+    stats_collect(my_stats, stats);
+}
+
+// free lists, tops and the largest free block of every arena, one class
+// lock at a time; only the highest populated class is walked for the
+// largest block, the rest come from the lists' counters
+static void report_arenas(alloc_heap_report_t *r) {
+    for (int n = 0; n < MAX_ARENAS; n++) {
+        arena_t *a = &arenas[n];
+        size_t mapped = atomic_load_explicit(&a->mapped, memory_order_relaxed);
+        if (mapped == 0) continue;
+        r->block_bytes += mapped;
+
+        uint64_t top = atomic_load_explicit(&a->top, memory_order_relaxed);
+        size_t unclaimed = WORDS_TO_BYTES((size_t)((word)(top >> 32) - (word)top));
+        r->unclaimed_bytes += unclaimed;
+        if (unclaimed > r->largest_free) r->largest_free = unclaimed;
+
+        // blocks too small for the block classes are what is left of splits
+        // and alignment; they share no figures with the slabs of their class
+        for (int i = 0; i <= SLAB_MAX_CLASS; i++) {
+            pthread_mutex_lock(&a->locks[i]);
+            size_t bytes = WORDS_TO_BYTES(a->free_words[i]);
+            pthread_mutex_unlock(&a->locks[i]);
+            r->fragment_bytes += bytes;
+            r->free_list_bytes += bytes;
+        }
+        for (int i = SLAB_MAX_CLASS + 1; i < NUM_SIZE_CLASSES; i++) {
+            pthread_mutex_lock(&a->locks[i]);
+            r->classes[i].free_objects += a->free_blocks[i];
+            r->classes[i].free_bytes += WORDS_TO_BYTES(a->free_words[i]);
+            pthread_mutex_unlock(&a->locks[i]);
+        }
+
+        uint64_t bits = atomic_load_explicit(&a->free_list_bits, memory_order_relaxed);
+        if (bits == 0) continue;
+        int highest = 63 - __builtin_clzll(bits);
+
+        pthread_mutex_lock(&a->locks[highest]);
+        header *hdr = a->free_lists[highest];
+        for (; hdr; hdr = offset_to_ptr(GET_FREE_PAYLOAD(hdr)->next_offset)) {
+            size_t bytes = WORDS_TO_BYTES((size_t)block_words(hdr));
+            if (bytes > r->largest_free) r->largest_free = bytes;
+        }
+        pthread_mutex_unlock(&a->locks[highest]);
+    }
+}
+
+// objects cached by every thread with a heap id, read while their owners
+// keep using them
+static void report_thread_caches(alloc_heap_report_t *r) {
+    pthread_mutex_lock(&thread_heap_lock);
+    for (word id = 1; id < next_heap_id; id++) {
+        thread_cache_t *caches = thread_heaps[id].caches;
+        if (caches == NULL) continue;
+
+        for (int i = 0; i < TOP_CLASS; i++) {
+            int n = __atomic_load_n(&caches[i].count, __ATOMIC_RELAXED);
+            r->classes[i].cached_objects += n;
+            r->thread_cache_bytes += CLASS_BYTES(i) * n;
+        }
+    }
+    pthread_mutex_unlock(&thread_heap_lock);
+}
+
+void alloc_heap_report(alloc_heap_report_t *r) {
+    alloc_stats_t stats;
+    alloc_stats(&stats);
+
+    memset(r, 0, sizeof(*r));
+    report_arenas(r);
+    report_thread_caches(r);
+
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        alloc_heap_class_t *c = &r->classes[i];
+        alloc_class_stats_t *s = &stats.classes[i];
+
+        // a free racing the read may be counted before its allocation
+        c->live_objects = s->allocs > s->frees ? s->allocs - s->frees : 0;
+        c->live_bytes = s->alloc_bytes > s->free_bytes ? s->alloc_bytes - s->free_bytes : 0;
+        r->live_bytes += c->live_bytes;
+
+        if (i == TOP_CLASS) {
+            r->free_list_bytes += c->free_bytes;
+            continue;
+        }
+
+        size_t percpu = atomic_load_explicit(&percpu_enabled, memory_order_relaxed)
+                      ? percpu_cached(i) : 0;
+        long parked = atomic_load_explicit(&transfer_objects[i], memory_order_relaxed);
+        if (parked < 0) parked = 0;
+        c->cached_objects += percpu + parked;
+        c->cached_bytes = CLASS_BYTES(i) * c->cached_objects;
+        r->percpu_cache_bytes += CLASS_BYTES(i) * percpu;
+        r->transfer_cache_bytes += CLASS_BYTES(i) * parked;
+
+        if (i <= SLAB_MAX_CLASS) {
+            size_t objects, used;
+            slab_usage(i, &objects, &used);
+            c->free_objects = objects - used;
+            c->free_bytes = CLASS_BYTES(i) * c->free_objects;
+            r->slab_free_bytes += c->free_bytes;
+        } else {
+            r->free_list_bytes += c->free_bytes;
+        }
+    }
+
+    r->slab_bytes = stats.segment_bytes > r->block_bytes ? stats.segment_bytes - r->block_bytes : 0;
+    r->slab_pool_bytes = slab_pool_bytes();
+
+    size_t free = r->free_list_bytes + r->unclaimed_bytes;
+    r->fragmentation = free ? 1.0 - (double)r->largest_free / free : 0;
+    size_t mapped = r->block_bytes + r->slab_bytes;
+    r->utilization = mapped ? (double)r->live_bytes / mapped : 0;
+}
+
+int alloc_set_percpu_cache(bool enabled) {
+    if (enabled) {
+        if (!percpu_init()) return ENOSYS;
+    } else if (atomic_load(&percpu_enabled)) {
+        percpu_drain();
+    }
+    atomic_store(&percpu_enabled, enabled);
+    return 0;
+}
+
+void alloc_set_thread_cache(bool enabled) {
+    if (!enabled) {
+        take_remote_frees(false);
+        release_thread_cache();
+    }
+    thread_cache_disabled = !enabled;
+}
+
+// give back everything the calling thread holds: cached blocks and the
+// rest of its span. runs automatically when a thread that used the
+// allocator exits
+void alloc_thread_flush(void) {
+    take_remote_frees(false);
+    release_thread_cache();
+    retire_span();
+    maybe_purge();
+}
+
+// taken in the order the allocator nests them: purging holds purge_lock
+// while draining the transfer caches into the arenas and slabs, and
+// arenas and slabs map segments while holding their own locks
+void alloc_prefork(void) {
+    profile_lock_all();
+    pthread_mutex_lock(&purge_thread_lock);
+    pthread_mutex_lock(&purge_lock);
+    pthread_mutex_lock(&thread_heap_lock);
+#ifndef LOCKFREE_LISTS
+    for (int i = 0; i < TOP_CLASS; i++) {
+        pthread_mutex_lock(&transfer_caches[i].lock);
+    }
+#endif
+    for (int n = 0; n < MAX_ARENAS; n++) {
+        pthread_mutex_lock(&arenas[n].expand_lock);
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+            pthread_mutex_lock(&arenas[n].locks[i]);
+        }
+    }
+    slab_lock_all();
+    heap_lock();
+}
+
+void alloc_postfork_parent(void) {
+    heap_unlock();
+    slab_unlock_all();
+    for (int n = MAX_ARENAS - 1; n >= 0; n--) {
+        for (int i = NUM_SIZE_CLASSES - 1; i >= 0; i--) {
+            pthread_mutex_unlock(&arenas[n].locks[i]);
+        }
+        pthread_mutex_unlock(&arenas[n].expand_lock);
+    }
+#ifndef LOCKFREE_LISTS
+    for (int i = TOP_CLASS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&transfer_caches[i].lock);
+    }
+#endif
+    pthread_mutex_unlock(&thread_heap_lock);
+    pthread_mutex_unlock(&purge_lock);
+    pthread_mutex_unlock(&purge_thread_lock);
+    profile_unlock_all();
+}
+
+// the child has only the forking thread: the background purge thread is
+// gone, and whatever other threads had cached stays lost to it
+void alloc_postfork_child(void) {
+    purge_thread_running = false;
+    alloc_postfork_parent();
+}
+
+void alloc_set_decay_ms(long ms) {
+    atomic_store(&decay_ms, ms);
+    atomic_store(&next_purge_ms, 0);
+}
+
+void alloc_purge(void) {
+    pthread_mutex_lock(&purge_lock);
+    purge_free_lists(true);
+    pthread_mutex_unlock(&purge_lock);
+}
+
+static void *purge_thread_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&purge_thread_lock);
+    while (purge_thread_running) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += PURGE_INTERVAL_MS / 1000;
+        until.tv_nsec += (PURGE_INTERVAL_MS % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&purge_thread_cond, &purge_thread_lock, &until);
+
+        if (!purge_thread_running) break;
+        pthread_mutex_unlock(&purge_thread_lock);
+        maybe_purge();
+        pthread_mutex_lock(&purge_thread_lock);
+    }
+    pthread_mutex_unlock(&purge_thread_lock);
+
+    return NULL;
+}
+
+// start or stop a thread that purges even when no thread is freeing memory,
+// so an idle process still shrinks back after a spike
+int alloc_background_purge(bool enable) {
+    pthread_mutex_lock(&purge_thread_lock);
+
+    if (enable == purge_thread_running) {
+        pthread_mutex_unlock(&purge_thread_lock);
+        return 0;
+    }
+
+    if (enable) {
+        purge_thread_running = true;
+        int err = pthread_create(&purge_thread, NULL, purge_thread_main, NULL);
+        if (err != 0) purge_thread_running = false;
+        pthread_mutex_unlock(&purge_thread_lock);
+        return err;
+    }
+
+    purge_thread_running = false;
+    pthread_cond_signal(&purge_thread_cond);
+    pthread_mutex_unlock(&purge_thread_lock);
+    return pthread_join(purge_thread, NULL);
+}
+
+// walk every segment in mapping order
+void show_heap(void) {
+    for (int i = 0; i < num_segments; i++) {
+        if (segments[i].kind == SEGMENT_SLABS) {
+            printf("Segment %d: %zu bytes of slabs at %p\n",
+                   i, segments[i].size, (void *)segments[i].base);
+            show_slabs(&segments[i]);
+        } else {
+            printf("Segment %d: %zu bytes of blocks in arena %d at %p\n",
+                   i, segments[i].size, segments[i].arena, (void *)segments[i].base);
+            show((header *)(segments[i].base + HEADER_SIZE));
+        }
+    }
+}
+
+// (re)initialize the heap; segments are mapped lazily by alloc(), so calling
+// this again throws away every block and starts from an empty heap
+void init_allocator(void) {
+    heap_reset();
+    slab_reset();
+    span_top = span_end = NULL;
+    atomic_store(&next_purge_ms, 0);
+
+    for (int n = 0; n < MAX_ARENAS; n++) {
+        arena_t *a = &arenas[n];
+        pthread_mutex_lock(&a->expand_lock);
+        atomic_store(&a->top, 0);
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+            a->free_lists[i] = NULL;
+        }
+        atomic_store(&a->free_list_bits, 0);
+        memset(a->free_blocks, 0, sizeof(a->free_blocks));
+        memset(a->free_words, 0, sizeof(a->free_words));
+        atomic_store(&a->mapped, 0);
+        atomic_store(&a->remote_frees, 0);
+        pthread_mutex_unlock(&a->expand_lock);
+    }
+    thread_arena = NULL;
+
+    for (int i = 0; i < TOP_CLASS; i++) {
+        transfer_reset(&transfer_caches[i]);
+        atomic_store(&transfer_objects[i], 0);
+    }
+
+    // other threads' caches are initialized automatically to zero, but the
+    // caller's may still point into the old segments
+    memset(thread_caches, 0, sizeof(thread_caches));
+    atomic_store(&cache_budget_used, 0);
+
+    // per-CPU caches likewise still point into the old segments
+    void *stale[PERCPU_CACHE_SIZE];
+    for (int cpu = 0; cpu < percpu_count(); cpu++) {
+        for (int i = 0; i < TOP_CLASS; i++) percpu_take_all(cpu, i, stale);
+    }
+
+    for (int i = 0; i <= MAX_THREAD_HEAPS; i++) {
+        atomic_store(&thread_heaps[i].remote, 0);
+    }
+    thread_cache_disabled = false;
+    stats_reset();
 }
@@ -8,60 +8,425 @@
 #include <errno.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
 
 #define packed __attribute__((__packed__))
 #define unused __attribute__((__unused__))
 
-#define MAXWORDS ((1024 * 1024 * 1024 / 4) - 2)
-#define NUM_SIZE_CLASSES 8
-#define THREAD_CACHE_SIZE 64  // blocks per size class per thread
+// the heap is a reserved address range mapped in segments on demand;
+// free list links are 32-bit word offsets from the start of the range
+#define SEGMENT_SIZE (4UL * 1024 * 1024)
+#define HEAP_RESERVE (16ULL * 1024 * 1024 * 1024)
+#define MAX_SEGMENTS (HEAP_RESERVE / SEGMENT_SIZE)
+#define SPAN_SIZE (256 * 1024)  // fresh memory each thread claims at a time
+#define NUM_SIZE_CLASSES 41  // at most 64, see free_list_bits
+#define TOP_CLASS (NUM_SIZE_CLASSES - 1)
+#define MAX_CLASS_WORDS 4096  // largest fixed class; bigger blocks go in TOP_CLASS
+#define LARGE_THRESHOLD (128 * 1024)  // bytes; bigger requests are mmap'd directly
+#define SLAB_SIZE (64 * 1024)  // bytes; slabs are SLAB_SIZE aligned
+#define SLAB_MAX_CLASS 23  // classes up to 256 words (1 KiB) live in slabs
+#define THREAD_CACHE_SIZE 128  // most blocks a thread caches per size class
+#define THREAD_CACHE_BUDGET (32 * 1024 * 1024)  // bytes all thread caches may grow into
+#define THREAD_CACHE_OVERFLOWS 3  // overflows tolerated before a cache shrinks
+#define PERCPU_CACHE_SIZE 64  // most objects each CPU caches per size class
+#define MAX_ARENAS 64  // independent block heaps threads are spread over
+#define ARENAS_PER_CPU 4  // default arena count is this many per CPU
+#define ARENA_CONTENTION 64  // contended lock waits before a thread changes arena
+#define MAX_NUMA_NODES 64  // nodes arenas can be bound to
+#define MAX_THREAD_HEAPS 1024  // threads that can receive remote frees at once
+#define TRANSFER_BATCH 32  // most blocks moved per refill or flush
+#define BATCH_BYTES (64 * 1024)  // batches of big classes are cut to about this
+#define TRANSFER_BATCHES 8  // most batches parked per class in the transfer cache
+#define TRANSFER_CACHE_BYTES (1024 * 1024)  // and at most this many bytes of them
+#define PURGE_DECAY_MS 10000  // how long free pages linger before going back to the OS
+#define PURGE_INTERVAL_MS 1000  // background purge thread wakeup period
+#define ALLOC_ALIGN 16  // alignment of blocks, large objects and slab objects of 16-byte sizes
 
 #define HEADER_SIZE sizeof(header)
-#define FOOTER_SIZE sizeof(footer)
-#define OVERHEAD (HEADER_SIZE + FOOTER_SIZE)
+#define OVERHEAD HEADER_SIZE
 
-#define err_no_mem 1
+#define err_no_mem ENOMEM
 #define reterr(x) do { errno = (x); return (void *)0; } while(0)
 
 typedef unsigned int int32;
 typedef int32 word;
 
-// block header - stores block metadata
+// block header, right before the payload. a block's footer (its size) is
+// only written while it is free, into the prev_w slot of the header after
+// it, and only read by the owner of that next block once it has claimed
+// BLOCK_PREV_FREE. a block and its header span a multiple of ALLOC_ALIGN
+// and the first header sits 8 bytes into its segment, so payloads stay
+// ALLOC_ALIGN aligned
 struct s_header {
-    word w;              // size in words (data region only, excludes header/footer)
-    bool alloced;        // true if allocated, false if free
-    word next_offset;    // offset to next block in free list (0 if not in list)
+    word prev_w;         // size of the previous block in words, valid while BLOCK_PREV_FREE
+    word info;           // size in words << BLOCK_FLAG_BITS | BLOCK_* flags
 };
 typedef struct s_header header;
 
-// block footer
-struct s_footer {
-    word w;              // size in words (must match header)
-    bool alloced;        // allocation status (must match header)
-};
-typedef struct s_footer footer;
+_Static_assert(sizeof(header) == 8, "payloads stay 8-byte aligned behind a header");
+
+#define BLOCK_ALLOCED 1u     // allocated, as opposed to free or cached
+#define BLOCK_LISTED 2u      // on a shared free list, i.e. coalescable
+#define BLOCK_PREV_FREE 4u   // the previous block is listed and prev_w holds its size
+#define BLOCK_FLAG_BITS 3
+
+// the info word is updated by its block's owner and, for BLOCK_PREV_FREE,
+// by whoever lists or unlists the previous block, so it is always accessed
+// atomically
+static inline word block_info(header *hdr) {
+    return __atomic_load_n(&hdr->info, __ATOMIC_RELAXED);
+}
+
+static inline word block_words(header *hdr) {
+    return block_info(hdr) >> BLOCK_FLAG_BITS;
+}
 
-#define GET_FOOTER(hdr) \
-    ((footer *)((char *)(hdr) + HEADER_SIZE + ((hdr)->w * sizeof(word))))
+static inline bool block_alloced(header *hdr) {
+    return (block_info(hdr) & BLOCK_ALLOCED) != 0;
+}
 
-#define GET_NEXT_HEADER(ftr) \
-    ((header *)((char *)(ftr) + FOOTER_SIZE))
+static inline bool block_listed(header *hdr) {
+    return (block_info(hdr) & BLOCK_LISTED) != 0;
+}
 
-#define GET_PREV_FOOTER(hdr) \
-    ((footer *)((char *)(hdr) - FOOTER_SIZE))
+static inline bool block_prev_free(header *hdr) {
+    return (block_info(hdr) & BLOCK_PREV_FREE) != 0;
+}
 
-#define GET_HEADER_FROM_FOOTER(ftr) \
-    ((header *)((char *)(ftr) - ((ftr)->w * sizeof(word)) - HEADER_SIZE))
+#define GET_NEXT_HEADER(hdr) \
+    ((header *)((char *)(hdr) + HEADER_SIZE + block_words(hdr) * sizeof(word)))
 
 // shared data, defined in alloc.c
 extern const word SIZE_CLASS_LIMITS[NUM_SIZE_CLASSES];
-extern header *free_lists[NUM_SIZE_CLASSES];
 
-// memory pool - defined in heap.c
-extern char memspace[];
+#define WORDS_TO_BYTES(w) ((w) * sizeof(word))
+#define CLASS_BYTES(class) WORDS_TO_BYTES((size_t)SIZE_CLASS_LIMITS[class])
+word now_ms(void);  // ms clock for purge ages, never 0
+
+// what a segment is carved into
+enum {
+    SEGMENT_BLOCKS = 0,  // boundary-tag blocks
+    SEGMENT_SLABS,       // SLAB_SIZE slabs of small objects
+};
+
+// a mapped chunk of the heap: for SEGMENT_BLOCKS, an unused header-sized
+// prologue, blocks and an epilogue header; for SEGMENT_SLABS, back to back slabs
+typedef struct {
+    char *base;          // first byte of the segment
+    size_t size;         // mapped bytes, a multiple of SEGMENT_SIZE
+    int kind;
+    int arena;           // arena whose blocks it holds
+} segment_t;
+
+// segment layer - defined in heap.c
+extern char *heap_base;
+extern size_t heap_page_size;
+extern segment_t segments[MAX_SEGMENTS];
+extern int num_segments;
+extern uint8_t segment_kinds[MAX_SEGMENTS];
+extern uint8_t segment_arenas[MAX_SEGMENTS];
+
+#define SEGMENT_KIND(ptr) \
+    (segment_kinds[((char *)(ptr) - heap_base) / SEGMENT_SIZE])
+
+#define SEGMENT_ARENA(ptr) \
+    (segment_arenas[((char *)(ptr) - heap_base) / SEGMENT_SIZE])
+
+segment_t *heap_map_segment(size_t bytes, int kind, int arena);
+void heap_reset(void);
+void heap_lock(void);
+void heap_unlock(void);
+void heap_purge(void *start, size_t len);
+void *heap_map_large(size_t bytes);
+void heap_unmap_large(void *ptr, size_t bytes);
+void *heap_remap_large(void *ptr, size_t old_bytes, size_t new_bytes);
+size_t heap_segment_bytes(void);
+size_t heap_large_bytes(void);
+int heap_numa_nodes(void);
+int heap_current_node(void);
+bool heap_bind_node(void *start, size_t len, int node);
+int heap_node_of(void *addr);
+
+// header at the start of every slab; objects follow it back to back
+typedef struct s_slab {
+    struct s_slab *next;     // partial list of its class, or the empty pool
+    struct s_slab *prev;
+    void *free;              // intrusive list of freed objects
+    word size_class;
+    word capacity;           // objects that fit after the header
+    word bump;               // objects handed out at least once
+    word used;               // objects allocated or sitting in thread caches
+    word freed_at;           // ms clock when it went back to the pool, 0 once purged
+    word owner;              // heap id of the thread that last took objects, 0 if none
+} slab_t;
+
+#define SLAB_OF(ptr) ((slab_t *)((uintptr_t)(ptr) & ~((uintptr_t)SLAB_SIZE - 1)))
+
+// a thread's cache of one size class: a stack of free payload pointers
+// whose capacity grows on misses and shrinks when frees keep overflowing it
+typedef struct {
+    void *blocks[THREAD_CACHE_SIZE];
+    int count;           // stored atomically by the owner so others may read it
+    int capacity;        // 0 until first used, then a multiple of the class's batch
+    int overflows;       // overflows since the capacity last changed
+} thread_cache_t;
+
+extern __thread thread_cache_t thread_caches[NUM_SIZE_CLASSES];
+
+// slab layer - defined in slab.c
+int slab_take(int size_class, void **objs, int n, word owner);
+void slab_return(int size_class, void **objs, int n);
+void slab_purge(word now, word decay, bool all);
+void slab_reset(void);
+void slab_lock_all(void);
+void slab_unlock_all(void);
+void slab_usage(int size_class, size_t *objects, size_t *used);
+size_t slab_pool_bytes(void);
+void show_slabs(segment_t *seg);
+
+// per-CPU layer - defined in percpu.c; pop and push run as restartable
+// sequences and report PERCPU_ABORTED when the thread was moved mid-way
+enum {
+    PERCPU_OK = 0,
+    PERCPU_ABORTED,
+    PERCPU_EMPTY,
+    PERCPU_FULL,
+};
+
+bool percpu_init(void);
+int percpu_cpu(void);
+int percpu_pop(int cpu, int size_class, void **item);
+int percpu_push(int cpu, int size_class, void *item, int capacity);
+int percpu_take_all(int cpu, int size_class, void **objs);
+int percpu_count(void);
+size_t percpu_cached(int size_class);
 
 // public api
 void init_allocator(void);
 void *alloc(int32 bytes);
 void dealloc(void *ptr);
-void show(header *hdr);
\ No newline at end of file
+void dealloc_sized(void *ptr, size_t bytes);  // bytes as passed to alloc or alloc_realloc
+void show(header *hdr);
+
+// malloc-style companions: alloc_realloc resizes in place when the next
+// block or the caller's span has room, alloc_calloc skips zeroing memory
+// that was never touched, and aligned requests free their padding as a block
+void *alloc_realloc(void *ptr, size_t bytes);
+void *alloc_calloc(size_t n, size_t size);
+void *alloc_aligned(size_t align, size_t bytes);
+int alloc_posix_memalign(void **out, size_t align, size_t bytes);
+size_t alloc_usable_size(void *ptr);
+void show_heap(void);
+
+// purging: free pages older than the decay time are returned to the OS
+void alloc_set_decay_ms(long ms);     // negative disables purging
+void alloc_purge(void);               // purge every free page now
+int alloc_background_purge(bool enable);
+
+// per-thread switch for the thread caches; with the cache off every free is
+// coalesced into the shared lists immediately
+void alloc_set_thread_cache(bool enabled);
+
+// how threads are spread over the arenas
+enum {
+    ARENA_ROUND_ROBIN = 0,  // in the order they first allocate
+    ARENA_BY_CPU,           // by the CPU they run on at the time
+};
+
+// split the block heap into `count` arenas (0 for ARENAS_PER_CPU per CPU),
+// each with its own free lists, locks and segments. threads already
+// assigned keep their arena until contention moves them
+int alloc_set_arenas(int count, int assign);
+
+// NUMA placement: arena i serves node i % nodes, its segments are bound to
+// that node and threads use the arenas of the node they run on. on by
+// default on multi-node machines; ENOSYS where the node layout is unknown
+int alloc_set_numa(bool enabled);
+int alloc_numa_nodes(void);
+
+typedef struct {
+    size_t mapped;        // bytes of block segments placed on the node
+    size_t remote_frees;  // blocks freed into the node's arenas from other nodes
+    int arenas;           // arenas in use that serve the node
+} alloc_node_stats_t;
+
+int alloc_node_stats(int node, alloc_node_stats_t *stats);  // EINVAL for a bad node
+
+// cache small objects per CPU instead of per thread, so memory held in
+// caches scales with cores rather than threads. returns ENOSYS where
+// restartable sequences are unavailable; only switch while no other
+// thread is allocating
+int alloc_set_percpu_cache(bool enabled);
+
+// return the calling thread's cached blocks and unused fresh memory to the
+// shared lists; done automatically at thread exit
+void alloc_thread_flush(void);
+
+// pthread_atfork handlers: every allocator lock is held across fork(), so
+// the child never inherits one taken by a thread that doesn't exist there
+void alloc_prefork(void);
+void alloc_postfork_parent(void);
+void alloc_postfork_child(void);
+
+// statistics: every thread counts its own events, which alloc_stats() sums
+// over live and exited threads on demand
+typedef struct {
+    uint64_t allocs;          // objects handed out, including by realloc
+    uint64_t frees;
+    uint64_t alloc_bytes;     // usable bytes of the objects handed out
+    uint64_t free_bytes;
+    uint64_t cache_hits;      // allocations served by a thread or per-CPU cache
+    uint64_t cache_misses;
+    uint64_t refills;         // batches fetched into a cache
+    uint64_t flushes;         // batches moved out of a full cache
+    uint64_t lock_waits;      // times an arena lock of the class was found taken
+} alloc_class_stats_t;
+
+#define STATS_LARGE NUM_SIZE_CLASSES  // slot of classes[] counting large objects
+
+typedef struct {
+    alloc_class_stats_t classes[NUM_SIZE_CLASSES + 1];
+    alloc_class_stats_t total;    // sum over the classes
+    size_t segment_bytes;         // mapped for block and slab segments
+    size_t large_bytes;           // mapped outside them: large objects, per-CPU caches
+    size_t active_bytes;          // usable bytes of live objects
+    int threads;                  // threads counting into a slot of their own
+} alloc_stats_t;
+
+void alloc_stats(alloc_stats_t *stats);
+void alloc_thread_stats(alloc_stats_t *stats);  // the caller's counters only; no heap-wide fields
+
+// the same as JSON, written like snprintf: returns the length it needs
+int alloc_stats_json(char *buf, size_t len);
+
+// heap health: where the mapped memory is, worked out from counters the
+// free lists, slabs and caches keep as they change rather than by walking
+// the heap. each lock is held only while its own figures are read, so
+// threads keep allocating meanwhile and the figures are a moment apart
+typedef struct {
+    uint64_t live_objects;     // allocated and not freed, from the counters
+    uint64_t live_bytes;
+    uint64_t free_objects;     // blocks on the arenas' free lists, or free slab slots
+    uint64_t free_bytes;
+    uint64_t cached_objects;   // in thread, per-CPU and transfer caches
+    uint64_t cached_bytes;
+} alloc_heap_class_t;
+
+typedef struct {
+    alloc_heap_class_t classes[NUM_SIZE_CLASSES];
+    size_t block_bytes;           // mapped for block segments
+    size_t slab_bytes;            // mapped for slab segments
+    size_t live_bytes;            // usable bytes of live objects in segments
+    size_t free_list_bytes;       // free blocks on the arenas' lists
+    size_t fragment_bytes;        // of those, blocks of slab sizes: split tails, alignment padding
+    size_t unclaimed_bytes;       // arena tops not carved into blocks yet
+    size_t largest_free;          // biggest free block or unclaimed top
+    size_t slab_free_bytes;       // free slots of slabs in use
+    size_t slab_pool_bytes;       // empty slabs and uncarved slab segment
+    size_t thread_cache_bytes;
+    size_t percpu_cache_bytes;
+    size_t transfer_cache_bytes;
+    double fragmentation;         // 1 - largest_free / (free_list_bytes + unclaimed_bytes)
+    double utilization;           // live_bytes / (block_bytes + slab_bytes)
+} alloc_heap_report_t;
+
+void alloc_heap_report(alloc_heap_report_t *report);
+int alloc_heap_report_json(char *buf, size_t len);  // like alloc_stats_json
+
+// sampling heap profiler: about one allocation in every `bytes` allocated
+// is sampled, with its call stack, and given a mapping of its own so that
+// frees of everything else never look it up. 0 (the default) stops
+// sampling; ENOMEM if the stack table can't be mapped
+int alloc_set_profile_rate(size_t bytes);
+
+// write the sampled live and cumulative heap by call stack to fd in the
+// gperftools heap profile format pprof reads; 0 or the errno of a write
+int alloc_profile_dump(int fd);
+
+// latency histograms, recorded only in builds with -DALLOC_LATENCY: every
+// alloc() and dealloc() is timed and filed under the path that served it
+enum {
+    LATENCY_HIT = 0,     // straight from a thread or per-CPU cache
+    LATENCY_REFILL,      // a cache miss that fetched a batch
+    LATENCY_SPLIT,       // taken from a larger class's free list and split
+    LATENCY_FRESH,       // carved from a span of never used memory
+    LATENCY_TOP,         // first-fit search of the top class
+    LATENCY_LARGE,       // mapped or unmapped as a large object
+    LATENCY_UNCACHED,    // thread cache switched off
+    LATENCY_FREE,        // a free that didn't flush
+    LATENCY_FLUSH,       // a free that moved a batch out of a full cache
+    LATENCY_PATHS,
+    LATENCY_ALL = LATENCY_PATHS,  // every path together, for alloc_latency()
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t p50_ns;     // each percentile to within 1/16
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} alloc_latency_t;
+
+// ENOSYS without -DALLOC_LATENCY, EINVAL for a bad path
+int alloc_latency(int path, alloc_latency_t *out);
+void alloc_latency_reset(void);
+
+// latency layer - defined in latency.c. values are rdtsc ticks on x86 and
+// nanoseconds elsewhere, converted when read
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS (61 * LATENCY_SUB_BUCKETS)
+
+#ifdef ALLOC_LATENCY
+extern __thread int latency_path;
+#define LATENCY_PATH(p) (latency_path = (p))
+
+static inline uint64_t latency_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void latency_record(int path, uint64_t ticks);
+#else
+#define LATENCY_PATH(p) ((void)0)
+#endif
+
+// profiling layer - defined in profile.c. each thread counts down the bytes
+// it allocates and only takes the slow path when the count runs out
+#define PROFILE_DEPTH 32  // frames kept per sampled stack
+#define PROFILE_STACKS 4096  // distinct stacks recorded
+#define PROFILE_SKIP_MAX 4  // allocator frames a caller may ask to skip
+#define PROFILE_IDLE_BYTES (1 << 20)  // countdown while sampling is off
+
+extern __thread long profile_countdown;
+
+bool profile_due(void);
+word profile_record(size_t bytes, int skip);
+void profile_release(word id, size_t bytes);
+void profile_lock_all(void);
+void profile_unlock_all(void);
+
+// stats layer - defined in stats.c. a thread counts into the slot of its
+// heap id with relaxed atomic stores, no dearer than a plain increment;
+// threads without an id share slot 0, which may lose a count to a race
+typedef struct {
+    alloc_class_stats_t classes[NUM_SIZE_CLASSES + 1];
+} __attribute__((aligned(64))) thread_stats_t;
+
+extern thread_stats_t thread_stats[MAX_THREAD_HEAPS + 1];
+
+static inline void stat_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void stats_attach(void);
+void stats_detach(thread_stats_t *slot);
+void stats_collect(thread_stats_t *slot, alloc_stats_t *stats);
+void stats_reset(void);
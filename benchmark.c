@@ -1,9 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <pthread.h>
 #include "alloc.h"
 #include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 
 #define NUM_OPERATIONS 1000000
@@ -132,7 +138,588 @@ double benchmark_multi_threaded_malloc(int num_threads, int ops_per_thread) {
 }
 
 
-int main() {
+// allocations per class over every run above, and how often the caches
+// had them ready
+static void print_class_distribution(void) {
+    alloc_stats_t stats;
+    alloc_stats(&stats);
+
+    printf("\nSize class distribution:\n");
+    printf("%-8s %-10s %-12s %-10s %-12s\n", "Class", "Size", "Allocs", "Hit rate", "Lock waits");
+    for (int i = 0; i <= NUM_SIZE_CLASSES; i++) {
+        alloc_class_stats_t *c = &stats.classes[i];
+        if (c->allocs == 0) continue;
+
+        uint64_t lookups = c->cache_hits + c->cache_misses;
+        printf("%-8d %-10zu %-12llu %-10.1f %-12llu\n",
+               i, i < TOP_CLASS ? CLASS_BYTES(i) : 0,
+               (unsigned long long)c->allocs,
+               lookups ? 100.0 * c->cache_hits / lookups : 0.0,
+               (unsigned long long)c->lock_waits);
+    }
+    printf("Mapped: %zu bytes in segments, %zu outside\n", stats.segment_bytes, stats.large_bytes);
+
+    alloc_heap_report_t r;
+    alloc_heap_report(&r);
+    printf("Heap: %.1f%% utilized, %.1f%% fragmented, largest free block %zu bytes, "
+           "%zu bytes cached\n", 100 * r.utilization, 100 * r.fragmentation, r.largest_free,
+           r.thread_cache_bytes + r.percpu_cache_bytes + r.transfer_cache_bytes);
+}
+
+// latency mode: each thread replaces random objects in a working set of
+// mixed sizes, so every path gets exercised: cache hits and refills for
+// small sizes, splits and fresh memory for bigger ones, and the odd large
+// object
+#define LATENCY_OPS 200000
+#define LATENCY_SLOTS 1024
+
+static const char *latency_paths[LATENCY_PATHS + 1] = {
+    "hit", "refill", "split", "fresh", "top", "large", "uncached", "free", "flush", "all",
+};
+
+static void *latency_worker(void *arg) {
+    unsigned int seed = 42 + (unsigned int)(long)arg * 12345;
+    void *slots[LATENCY_SLOTS] = {0};
+
+    for (int i = 0; i < LATENCY_OPS; i++) {
+        int r = rand_r(&seed);
+        int slot = r % LATENCY_SLOTS;
+        int pick = (r >> 10) % 1000;
+        int size = pick < 900 ? 8 + (r >> 20) % 249          // small, slab classes
+                 : pick < 990 ? 257 + (r >> 20) % 16128      // blocks
+                 : pick < 999 ? 16385 + (r >> 20) % 49152    // top class
+                 : 200000;                                   // large
+
+        dealloc(slots[slot]);
+        slots[slot] = alloc(size);
+    }
+
+    for (int i = 0; i < LATENCY_SLOTS; i++) dealloc(slots[i]);
+    return NULL;
+}
+
+static int latency_benchmark(void) {
+    alloc_latency_t l;
+    if (alloc_latency(LATENCY_ALL, &l) == ENOSYS) {
+        printf("latency histograms need an instrumented build: make latency_benchmark\n");
+        return 1;
+    }
+
+    printf("=== Allocation Latency ===\n");
+    printf("Operations per thread: %d | working set: %d objects\n\n", LATENCY_OPS, LATENCY_SLOTS);
+    printf("%-8s %-9s %10s %9s %9s %10s %10s\n",
+           "Threads", "Path", "Count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+
+    int thread_counts[] = {1, 2, 4, 8};
+    for (int t = 0; t < 4; t++) {
+        int num_threads = thread_counts[t];
+        pthread_t threads[num_threads];
+
+        init_allocator();
+        alloc_latency_reset();
+        for (int i = 0; i < num_threads; i++) {
+            pthread_create(&threads[i], NULL, latency_worker, (void *)(long)i);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        for (int p = 0; p <= LATENCY_ALL; p++) {
+            alloc_latency(p, &l);
+            if (l.count == 0) continue;
+            printf("%-8d %-9s %10llu %9llu %9llu %10llu %10llu\n", num_threads, latency_paths[p],
+                   (unsigned long long)l.count, (unsigned long long)l.p50_ns,
+                   (unsigned long long)l.p99_ns, (unsigned long long)l.p999_ns,
+                   (unsigned long long)l.max_ns);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+// scenarios mode: workloads shaped like real programs rather than
+// alloc-then-free pairs, each run on this allocator and on the system
+// malloc. every run gets a forked process of its own, so peak RSS is that
+// run's alone and memory one allocator kept doesn't count against the next
+#define SCENARIO_THREADS 4
+#define MAX_WORKERS 16
+#define MAX_SIZE_BINS 256
+
+typedef struct {
+    const char *name;
+    void *(*alloc)(size_t);
+    void (*free)(void *);
+} allocator_t;
+
+static void *custom_alloc(size_t size) { return alloc((int32)size); }
+static void custom_free(void *p) { dealloc(p); }
+
+static const allocator_t allocators[] = {
+    { "custom", custom_alloc, custom_free },
+    { "system", malloc, free },
+};
+
+static const allocator_t *A;
+
+// object sizes are drawn from a histogram: each bin covers the sizes above
+// the previous bin's up to its own. the built-in one is weighted the way
+// traces of servers usually are, mostly small objects with a long thin
+// tail; `./bench scenarios <file>` reads "size count" lines instead
+typedef struct {
+    size_t size;
+    uint64_t weight;
+} size_bin_t;
+
+static size_bin_t size_bins[MAX_SIZE_BINS] = {
+    {8, 500}, {16, 1500}, {24, 1000}, {32, 1200}, {48, 1000}, {64, 900}, {96, 800},
+    {128, 700}, {192, 450}, {256, 400}, {384, 300}, {512, 300}, {1024, 400}, {2048, 250},
+    {4096, 150}, {8192, 80}, {16384, 40}, {65536, 20}, {262144, 10},
+};
+static int num_size_bins = 19;
+static uint64_t size_weights = 10000;
+
+static int compare_bins(const void *a, const void *b) {
+    size_t x = ((const size_bin_t *)a)->size, y = ((const size_bin_t *)b)->size;
+    return (x > y) - (x < y);
+}
+
+static int load_size_bins(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+
+    unsigned long long size, count;
+    num_size_bins = 0;
+    size_weights = 0;
+    while (num_size_bins < MAX_SIZE_BINS && fscanf(f, "%llu %llu", &size, &count) == 2) {
+        if (count == 0) continue;
+        // every object carries its size in its first word
+        if (size < sizeof(size_t)) size = sizeof(size_t);
+        size_bins[num_size_bins++] = (size_bin_t){ size, count };
+        size_weights += count;
+    }
+    fclose(f);
+    if (num_size_bins == 0) return -1;
+
+    qsort(size_bins, num_size_bins, sizeof(size_bin_t), compare_bins);
+    return 0;
+}
+
+static size_t random_size(unsigned int *seed) {
+    uint64_t r = (((uint64_t)rand_r(seed) << 31) | rand_r(seed)) % size_weights;
+    int i = 0;
+    while (r >= size_bins[i].weight) r -= size_bins[i++].weight;
+
+    size_t low = i == 0 ? sizeof(size_t) : size_bins[i - 1].size + 1;
+    if (low > size_bins[i].size) low = size_bins[i].size;
+    return low + rand_r(seed) % (size_bins[i].size - low + 1);
+}
+
+static double mean_size(void) {
+    double sum = 0;
+    for (int i = 0; i < num_size_bins; i++) {
+        size_t low = i == 0 ? sizeof(size_t) : size_bins[i - 1].size + 1;
+        if (low > size_bins[i].size) low = size_bins[i].size;
+        sum += (double)size_bins[i].weight * (low + size_bins[i].size) / 2;
+    }
+    return sum / size_weights;
+}
+
+// the bytes a worker has live and the operations it made. only the worker
+// writes them; the sampler sums live over all workers while they run
+typedef struct {
+    _Alignas(64) long live;
+    long ops;
+} worker_t;
+
+static worker_t workers[MAX_WORKERS];
+static atomic_bool sampling;
+static long peak_live = 0;
+
+// objects hold their size in the first word and have every page touched,
+// as a program filling them would, so RSS counts them
+static void *obj_new(worker_t *w, size_t size) {
+    char *p = A->alloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "out of memory allocating %zu bytes\n", size);
+        _exit(1);
+    }
+    *(size_t *)p = size;
+    for (size_t off = 4096; off < size; off += 4096) p[off] = 1;
+
+    __atomic_store_n(&w->live, w->live + (long)size, __ATOMIC_RELAXED);
+    w->ops++;
+    return p;
+}
+
+static void obj_delete(worker_t *w, void *p) {
+    if (p == NULL) return;
+    __atomic_store_n(&w->live, w->live - (long)*(size_t *)p, __ATOMIC_RELAXED);
+    w->ops++;
+    A->free(p);
+}
+
+static long rss_bytes(void) {
+    long pages[2] = {0};
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) return 0;
+    if (fscanf(f, "%ld %ld", &pages[0], &pages[1]) != 2) pages[1] = 0;
+    fclose(f);
+    return pages[1] * sysconf(_SC_PAGESIZE);
+}
+
+static void *sampler(void *arg) {
+    (void)arg;
+    struct timespec tick = { 0, 1000000 };
+    while (atomic_load(&sampling)) {
+        long live = 0;
+        for (int i = 0; i < MAX_WORKERS; i++) {
+            live += __atomic_load_n(&workers[i].live, __ATOMIC_RELAXED);
+        }
+        if (live > peak_live) peak_live = live;
+        nanosleep(&tick, NULL);
+    }
+    return NULL;
+}
+
+static void run_threads(int n, void *(*fn)(void *)) {
+    pthread_t threads[n];
+    for (long i = 0; i < n; i++) pthread_create(&threads[i], NULL, fn, (void *)i);
+    for (int i = 0; i < n; i++) pthread_join(threads[i], NULL);
+}
+
+// working set: each thread keeps a set of objects and replaces random
+// ones, so lifetimes are random and long, and the heap never drains
+#define WORKING_SET_SLOTS 16384
+#define WORKING_SET_OPS 400000
+
+static void *working_set_worker(void *arg) {
+    worker_t *w = &workers[(long)arg];
+    unsigned int seed = 42 + (unsigned int)(long)arg * 12345;
+    void **slots = calloc(WORKING_SET_SLOTS, sizeof(void *));
+
+    for (int i = 0; i < WORKING_SET_SLOTS; i++) slots[i] = obj_new(w, random_size(&seed));
+    for (int i = 0; i < WORKING_SET_OPS; i++) {
+        int slot = rand_r(&seed) % WORKING_SET_SLOTS;
+        obj_delete(w, slots[slot]);
+        slots[slot] = obj_new(w, random_size(&seed));
+    }
+    for (int i = 0; i < WORKING_SET_SLOTS; i++) obj_delete(w, slots[i]);
+
+    free(slots);
+    return NULL;
+}
+
+static void working_set(void) {
+    run_threads(SCENARIO_THREADS, working_set_worker);
+}
+
+// producer/consumer: pairs of threads joined by a ring; every object is
+// freed by a thread other than the one that allocated it
+#define RING_SLOTS 1024
+#define PRODUCER_OBJECTS 400000
+
+typedef struct {
+    _Alignas(64) atomic_long head;
+    _Alignas(64) atomic_long tail;
+    void *slots[RING_SLOTS];
+} ring_t;
+
+static ring_t rings[SCENARIO_THREADS / 2];
+
+static void *producer(void *arg) {
+    long id = (long)arg;
+    worker_t *w = &workers[id];
+    ring_t *ring = &rings[id];
+    unsigned int seed = 42 + (unsigned int)id * 12345;
+
+    for (long i = 0; i < PRODUCER_OBJECTS; i++) {
+        void *p = obj_new(w, random_size(&seed));
+        long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SLOTS) {
+            sched_yield();
+        }
+        ring->slots[tail % RING_SLOTS] = p;
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    long id = (long)arg;
+    worker_t *w = &workers[SCENARIO_THREADS / 2 + id];
+    ring_t *ring = &rings[id];
+
+    for (long head = 0; head < PRODUCER_OBJECTS; head++) {
+        while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) sched_yield();
+        obj_delete(w, ring->slots[head % RING_SLOTS]);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void *producer_consumer_worker(void *arg) {
+    long i = (long)arg;
+    return i % 2 == 0 ? producer((void *)(i / 2)) : consumer((void *)(i / 2));
+}
+
+static void producer_consumer(void) {
+    run_threads(SCENARIO_THREADS, producer_consumer_worker);
+}
+
+// bursts: each thread grows its heap quickly, then frees nine objects in
+// ten in random order and grows again from what is left. what RSS does
+// once everything is gone shows how much memory is given back
+#define BURST_OBJECTS 32768
+#define BURSTS 4
+
+static void *burst_worker(void *arg) {
+    worker_t *w = &workers[(long)arg];
+    unsigned int seed = 42 + (unsigned int)(long)arg * 12345;
+    void **objs = calloc(BURST_OBJECTS, sizeof(void *));
+    int n = 0;
+
+    for (int b = 0; b < BURSTS; b++) {
+        while (n < BURST_OBJECTS) objs[n++] = obj_new(w, random_size(&seed));
+        while (n > BURST_OBJECTS / 10) {
+            int victim = rand_r(&seed) % n;
+            obj_delete(w, objs[victim]);
+            objs[victim] = objs[--n];
+        }
+    }
+    while (n > 0) obj_delete(w, objs[--n]);
+
+    free(objs);
+    return NULL;
+}
+
+static void bursts(void) {
+    run_threads(SCENARIO_THREADS, burst_worker);
+}
+
+// larson: as in Larson and Krishnan's server benchmark, threads replace
+// random objects in arrays they inherit, then exit and hand the arrays to
+// new threads, which go on to free what the dead ones allocated
+#define LARSON_THREADS 8
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 10
+#define LARSON_OPS 20000
+
+static void *larson_arrays[LARSON_THREADS][LARSON_SLOTS];
+static int larson_round;
+
+static size_t larson_size(unsigned int *seed) {
+    return 8 + rand_r(seed) % 993;
+}
+
+static void *larson_worker(void *arg) {
+    long id = ((long)arg + larson_round) % LARSON_THREADS;
+    worker_t *w = &workers[id];
+    void **slots = larson_arrays[id];
+    unsigned int seed = 42 + (unsigned int)(id * 12345 + larson_round);
+
+    for (int i = 0; i < LARSON_OPS; i++) {
+        int slot = rand_r(&seed) % LARSON_SLOTS;
+        obj_delete(w, slots[slot]);
+        slots[slot] = obj_new(w, larson_size(&seed));
+    }
+    return NULL;
+}
+
+static void larson(void) {
+    unsigned int seed = 42;
+    for (int t = 0; t < LARSON_THREADS; t++) {
+        for (int i = 0; i < LARSON_SLOTS; i++) {
+            larson_arrays[t][i] = obj_new(&workers[t], larson_size(&seed));
+        }
+    }
+    for (larson_round = 0; larson_round < LARSON_ROUNDS; larson_round++) {
+        run_threads(LARSON_THREADS, larson_worker);
+    }
+    for (int t = 0; t < LARSON_THREADS; t++) {
+        for (int i = 0; i < LARSON_SLOTS; i++) obj_delete(&workers[t], larson_arrays[t][i]);
+    }
+}
+
+// xmalloc: as in Lever and Boreham's test, every thread allocates batches
+// of small objects onto a shared queue and frees whichever batch is at its
+// head, mostly one another thread allocated. the queue is kept some
+// batches deep, so objects live a while before they are freed
+#define XMALLOC_BATCH 128
+#define XMALLOC_BATCHES 3000
+#define XMALLOC_QUEUED 256
+
+typedef struct batch {
+    size_t size;             // as in every object
+    struct batch *next;
+    void *objs[XMALLOC_BATCH];
+} batch_t;
+
+static batch_t *queue_head = NULL, *queue_tail = NULL;
+static int queued = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_batch(worker_t *w, batch_t *b) {
+    for (int i = 0; i < XMALLOC_BATCH; i++) obj_delete(w, b->objs[i]);
+    obj_delete(w, b);
+}
+
+static void *xmalloc_worker(void *arg) {
+    worker_t *w = &workers[(long)arg];
+    unsigned int seed = 42 + (unsigned int)(long)arg * 12345;
+
+    for (int n = 0; n < XMALLOC_BATCHES; n++) {
+        batch_t *b = obj_new(w, sizeof(batch_t));
+        for (int i = 0; i < XMALLOC_BATCH; i++) b->objs[i] = obj_new(w, 8 + rand_r(&seed) % 121);
+
+        pthread_mutex_lock(&queue_lock);
+        b->next = NULL;
+        if (queue_tail) queue_tail->next = b;
+        else queue_head = b;
+        queue_tail = b;
+
+        b = NULL;
+        if (++queued > XMALLOC_QUEUED) {
+            b = queue_head;
+            queue_head = b->next;
+            queued--;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        if (b) free_batch(w, b);
+    }
+    return NULL;
+}
+
+static void xmalloc_test(void) {
+    run_threads(SCENARIO_THREADS, xmalloc_worker);
+    while (queue_head) {
+        batch_t *b = queue_head;
+        queue_head = b->next;
+        free_batch(&workers[0], b);
+    }
+}
+
+typedef struct {
+    const char *name;
+    int threads;
+    void (*run)(void);
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    { "working-set", SCENARIO_THREADS, working_set },
+    { "prod-cons", SCENARIO_THREADS, producer_consumer },
+    { "bursts", SCENARIO_THREADS, bursts },
+    { "larson", LARSON_THREADS, larson },
+    { "xmalloc", SCENARIO_THREADS, xmalloc_test },
+};
+
+#define NUM_SCENARIOS (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+typedef struct {
+    bool ok;
+    double seconds;
+    long ops;
+    long peak_live;          // bytes the program had, sampled every ms
+    long peak_rss;           // over what the process had before the run
+    long end_rss;            // once everything was freed
+} scenario_result_t;
+
+static void run_scenario(const scenario_t *s, int fd) {
+    if (A->alloc == custom_alloc) init_allocator();
+
+    scenario_result_t r = { .ok = true };
+    long base = rss_bytes();
+    pthread_t sampler_thread;
+    atomic_store(&sampling, true);
+    pthread_create(&sampler_thread, NULL, sampler, NULL);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    s->run();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    atomic_store(&sampling, false);
+    pthread_join(sampler_thread, NULL);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    r.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    for (int i = 0; i < MAX_WORKERS; i++) r.ops += workers[i].ops;
+    r.peak_live = peak_live;
+    r.peak_rss = usage.ru_maxrss * 1024 - base;
+    r.end_rss = rss_bytes() - base;
+
+    if (write(fd, &r, sizeof(r)) != sizeof(r)) _exit(1);
+    _exit(0);
+}
+
+static scenario_result_t fork_scenario(const scenario_t *s, const allocator_t *a) {
+    scenario_result_t r = { .ok = false };
+    int fds[2];
+    if (pipe(fds) < 0) return r;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        A = a;
+        run_scenario(s, fds[1]);
+    }
+    close(fds[1]);
+    if (pid > 0) {
+        if (read(fds[0], &r, sizeof(r)) != sizeof(r)) r.ok = false;
+        waitpid(pid, NULL, 0);
+    }
+    close(fds[0]);
+    return r;
+}
+
+#define MB(bytes) ((double)(bytes) / (1024 * 1024))
+
+static int scenario_benchmark(const char *sizes) {
+    if (sizes && load_size_bins(sizes) < 0) {
+        fprintf(stderr, "can't read size histogram from %s\n", sizes);
+        return 1;
+    }
+
+    printf("=== Workload Scenarios ===\n");
+    printf("Sizes: %s, %d bins, mean %.0f bytes\n\n", sizes ? sizes : "built-in", num_size_bins,
+           mean_size());
+    printf("%-12s %-8s %7s %12s %10s %10s %9s %9s\n", "Scenario", "Alloc", "Threads",
+           "Ops/s", "Peak live", "Peak RSS", "Overhead", "End RSS");
+    printf("%-12s %-8s %7s %12s %10s %10s %9s %9s\n", "", "", "", "", "MB", "MB", "", "MB");
+
+    for (int s = 0; s < NUM_SCENARIOS; s++) {
+        scenario_result_t r[2];
+        for (int a = 0; a < 2; a++) {
+            r[a] = fork_scenario(&scenarios[s], &allocators[a]);
+            if (!r[a].ok) {
+                printf("%-12s %-8s failed\n", scenarios[s].name, allocators[a].name);
+                continue;
+            }
+            // RSS per byte the program held at its peak
+            printf("%-12s %-8s %7d %12.0f %10.1f %10.1f %9.2f %9.1f\n", scenarios[s].name,
+                   allocators[a].name, scenarios[s].threads, r[a].ops / r[a].seconds,
+                   MB(r[a].peak_live), MB(r[a].peak_rss),
+                   r[a].peak_live ? (double)r[a].peak_rss / r[a].peak_live : 0.0,
+                   MB(r[a].end_rss));
+        }
+        if (r[0].ok && r[1].ok) {
+            printf("%-12s %-8s %7s %11.2fx %10s %9.2fx\n", "", "ratio", "",
+                   r[1].seconds / r[0].seconds * r[0].ops / r[1].ops, "",
+                   r[1].peak_rss ? (double)r[0].peak_rss / r[1].peak_rss : 0.0);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "latency") == 0) return latency_benchmark();
+    if (argc > 1 && strcmp(argv[1], "scenarios") == 0) {
+        return scenario_benchmark(argc > 2 ? argv[2] : NULL);
+    }
+
     init_allocator();
 
     printf("=== Memory Allocator Benchmark ===\n");
@@ -201,7 +788,7 @@ int main() {
     }
 
     printf("\n=== Benchmark Complete ===\n");
-    printf("\nSize class distribution:\n");
+    print_class_distribution();
 
     return 0;
 }
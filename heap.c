@@ -1 +1,224 @@
-char memspace[1024ULL * 1024 * 1024];
\ No newline at end of file
+#include "alloc.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+
+// NUMA placement uses the raw syscalls, so there is no libnuma dependency
+#define MPOL_PREFERRED 1
+#define MPOL_F_ADDR (1 << 1)
+
+// reserved (but uncommitted) address range that all segments are carved from
+char *heap_base = NULL;
+
+// segments in the order they were mapped
+segment_t segments[MAX_SEGMENTS];
+int num_segments = 0;
+
+// kind of the segment covering each SEGMENT_SIZE granule of the reservation
+uint8_t segment_kinds[MAX_SEGMENTS];
+
+// arena owning each granule's blocks; 0 for slab segments
+uint8_t segment_arenas[MAX_SEGMENTS];
+
+size_t heap_page_size = 4096;
+
+// bytes of the reservation handed out so far
+static size_t heap_mapped = 0;
+
+// bytes mapped outside the reservation
+static atomic_size_t large_mapped = 0;
+
+static pthread_mutex_t segment_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// reserve the address range without committing any memory; the base is
+// SEGMENT_SIZE aligned so slabs inside segments can be found by masking
+static bool heap_reserve(void) {
+    size_t slack = SEGMENT_SIZE;
+    char *p = mmap(NULL, HEAP_RESERVE + slack, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return false;
+
+    char *base = (char *)(((uintptr_t)p + SEGMENT_SIZE - 1) & ~(SEGMENT_SIZE - 1));
+    if (base > p) munmap(p, base - p);
+    if (base + HEAP_RESERVE < p + HEAP_RESERVE + slack) {
+        munmap(base + HEAP_RESERVE, p + slack - base);
+    }
+
+    heap_base = base;
+    heap_page_size = (size_t)sysconf(_SC_PAGESIZE);
+    return true;
+}
+
+// map a new segment of at least `bytes` bytes (rounded up to SEGMENT_SIZE)
+segment_t *heap_map_segment(size_t bytes, int kind, int arena) {
+    size_t size = (bytes + SEGMENT_SIZE - 1) & ~(SEGMENT_SIZE - 1);
+    segment_t *seg = NULL;
+
+    pthread_mutex_lock(&segment_lock);
+
+    if (heap_base == NULL && !heap_reserve()) goto out;
+    if (size > HEAP_RESERVE - heap_mapped) goto out;
+
+    char *base = heap_base + heap_mapped;
+    if (mmap(base, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        goto out;
+    }
+
+    memset(&segment_kinds[heap_mapped / SEGMENT_SIZE], kind, size / SEGMENT_SIZE);
+    memset(&segment_arenas[heap_mapped / SEGMENT_SIZE], arena, size / SEGMENT_SIZE);
+    heap_mapped += size;
+    seg = &segments[num_segments++];
+    seg->base = base;
+    seg->size = size;
+    seg->kind = kind;
+    seg->arena = arena;
+
+out:
+    pthread_mutex_unlock(&segment_lock);
+    return seg;
+}
+
+// hold the segment table still across fork()
+void heap_lock(void) {
+    pthread_mutex_lock(&segment_lock);
+}
+
+void heap_unlock(void) {
+    pthread_mutex_unlock(&segment_lock);
+}
+
+// drop every segment and hand the pages back, keeping the reservation
+void heap_reset(void) {
+    pthread_mutex_lock(&segment_lock);
+
+    if (heap_mapped > 0) {
+        mmap(heap_base, heap_mapped, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    }
+    memset(segment_kinds, 0, heap_mapped / SEGMENT_SIZE);
+    memset(segment_arenas, 0, heap_mapped / SEGMENT_SIZE);
+    heap_mapped = 0;
+    num_segments = 0;
+
+    pthread_mutex_unlock(&segment_lock);
+}
+
+// give the whole pages inside [start, start + len) back to the OS; the range
+// stays mapped and its contents are undefined until written again
+void heap_purge(void *start, size_t len) {
+    uintptr_t lo = ((uintptr_t)start + heap_page_size - 1) & ~(heap_page_size - 1);
+    uintptr_t hi = ((uintptr_t)start + len) & ~(heap_page_size - 1);
+    if (hi <= lo) return;
+
+#ifdef __linux__
+    madvise((void *)lo, hi - lo, MADV_DONTNEED);
+#else
+    madvise((void *)lo, hi - lo, MADV_FREE);
+#endif
+}
+
+// nodes the kernel has online, i.e. the highest node id + 1 from sysfs;
+// 0 where that isn't available. read with open/read since stdio allocates
+int heap_numa_nodes(void) {
+    char buf[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return 0;
+    buf[len] = '\0';
+
+    // a list of ids and ranges such as "0-3,5"; the last number is the highest
+    int highest = -1, id = -1;
+    for (char *p = buf; *p; p++) {
+        if (*p >= '0' && *p <= '9') {
+            id = (id < 0 ? 0 : id * 10) + (*p - '0');
+        } else {
+            if (id > highest) highest = id;
+            id = -1;
+        }
+    }
+    if (id > highest) highest = id;
+    return highest + 1;
+}
+
+// node the calling thread is running on, 0 if unknown
+int heap_current_node(void) {
+#ifdef SYS_getcpu
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) return (int)node;
+#endif
+    return 0;
+}
+
+// prefer `node` for the pages of [start, start + len) when they are first
+// touched; the kernel falls back to other nodes rather than failing
+bool heap_bind_node(void *start, size_t len, int node) {
+#ifdef SYS_mbind
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, start, len, MPOL_PREFERRED, &mask,
+                   sizeof(mask) * 8 + 1, 0) == 0;
+#else
+    (void)start; (void)len; (void)node;
+    return false;
+#endif
+}
+
+// node an address has been bound to with heap_bind_node, or -1
+int heap_node_of(void *addr) {
+#ifdef SYS_get_mempolicy
+    int mode;
+    unsigned long mask = 0;
+    if (syscall(SYS_get_mempolicy, &mode, &mask, sizeof(mask) * 8 + 1,
+                addr, MPOL_F_ADDR) != 0) {
+        return -1;
+    }
+    if (mode != MPOL_PREFERRED || mask == 0) return -1;
+    return __builtin_ctzl(mask);
+#else
+    (void)addr;
+    return -1;
+#endif
+}
+
+// large objects live in their own mappings outside the reservation
+void *heap_map_large(size_t bytes) {
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+    atomic_fetch_add_explicit(&large_mapped, bytes, memory_order_relaxed);
+    return p;
+}
+
+void heap_unmap_large(void *ptr, size_t bytes) {
+    munmap(ptr, bytes);
+    atomic_fetch_sub_explicit(&large_mapped, bytes, memory_order_relaxed);
+}
+
+// resize a large mapping, moving it if it can't grow where it is
+void *heap_remap_large(void *ptr, size_t old_bytes, size_t new_bytes) {
+#ifdef __linux__
+    void *p = mremap(ptr, old_bytes, new_bytes, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED) return NULL;
+
+    atomic_fetch_add_explicit(&large_mapped, new_bytes - old_bytes, memory_order_relaxed);
+    return p;
+#else
+    (void)ptr; (void)old_bytes; (void)new_bytes;
+    return NULL;
+#endif
+}
+
+// bytes mapped for segments, and outside the reservation
+size_t heap_segment_bytes(void) {
+    pthread_mutex_lock(&segment_lock);
+    size_t bytes = heap_mapped;
+    pthread_mutex_unlock(&segment_lock);
+    return bytes;
+}
+
+size_t heap_large_bytes(void) {
+    return atomic_load_explicit(&large_mapped, memory_order_relaxed);
+}
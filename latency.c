@@ -0,0 +1,173 @@
+#include "alloc.h"
+
+#ifdef ALLOC_LATENCY
+// one thread's histograms. the owner is the only writer and stores each
+// count atomically, so readers can sum them while it keeps allocating; a
+// histogram outlives its thread and is handed to the next one to start,
+// counts and all, so nothing recorded is lost
+typedef struct latency_hist {
+    uint64_t counts[LATENCY_PATHS][LATENCY_BUCKETS];
+    uint64_t max[LATENCY_PATHS];
+    struct latency_hist *next;
+    bool in_use;
+} latency_hist_t;
+
+static latency_hist_t *hists = NULL;
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t hist_key;
+static pthread_once_t hist_once = PTHREAD_ONCE_INIT;
+
+__thread int latency_path = LATENCY_HIT;
+static __thread latency_hist_t *my_hist = NULL;
+
+static void release_hist(void *arg) {
+    latency_hist_t *h = arg;
+    pthread_mutex_lock(&hist_lock);
+    h->in_use = false;
+    pthread_mutex_unlock(&hist_lock);
+    my_hist = NULL;
+}
+
+static void create_hist_key(void) {
+    pthread_key_create(&hist_key, release_hist);
+}
+
+// a histogram for the calling thread: one a finished thread left, or a
+// new mapping. my_hist is set before pthread_setspecific, which may itself
+// allocate and so record
+static latency_hist_t *acquire_hist(void) {
+    pthread_mutex_lock(&hist_lock);
+    latency_hist_t *h = hists;
+    while (h && h->in_use) h = h->next;
+    if (h == NULL) {
+        h = heap_map_large(sizeof(latency_hist_t));
+        if (h) {
+            h->next = hists;
+            hists = h;
+        }
+    }
+    if (h) h->in_use = true;
+    pthread_mutex_unlock(&hist_lock);
+    if (h == NULL) return NULL;
+
+    my_hist = h;
+    pthread_once(&hist_once, create_hist_key);
+    pthread_setspecific(hist_key, h);
+    return h;
+}
+
+// log-linear buckets as in HdrHistogram: values below 16 get one each,
+// every doubling above is split in 16, so a bucket is within 1/16 of
+// whatever landed in it
+static inline int bucket_of(uint64_t ticks) {
+    if (ticks < LATENCY_SUB_BUCKETS) return (int)ticks;
+    int e = 63 - __builtin_clzll(ticks);
+    int sub = (int)(ticks >> (e - 4)) & (LATENCY_SUB_BUCKETS - 1);
+    return (e - 3) * LATENCY_SUB_BUCKETS + sub;
+}
+
+// the largest value a bucket holds
+static uint64_t bucket_top(int b) {
+    if (b < LATENCY_SUB_BUCKETS) return (uint64_t)b;
+    int e = b / LATENCY_SUB_BUCKETS + 3;
+    uint64_t sub = b % LATENCY_SUB_BUCKETS;
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << (e - 4)) - 1;
+}
+
+void latency_record(int path, uint64_t ticks) {
+    latency_hist_t *h = my_hist;
+    if (h == NULL && (h = acquire_hist()) == NULL) return;
+
+    stat_add(&h->counts[path][bucket_of(ticks)], 1);
+    if (ticks > __atomic_load_n(&h->max[path], __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max[path], ticks, __ATOMIC_RELAXED);
+    }
+}
+
+// nanoseconds per tick, measured once against the monotonic clock
+static double ns_per_tick = 1;
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void calibrate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t ns0 = monotonic_ns(), t0 = latency_now();
+    while (monotonic_ns() - ns0 < 20000000) {
+    }
+    uint64_t ns1 = monotonic_ns(), t1 = latency_now();
+    ns_per_tick = (double)(ns1 - ns0) / (double)(t1 - t0);
+#endif
+}
+
+int alloc_latency(int path, alloc_latency_t *out) {
+    if (path < 0 || path > LATENCY_ALL) return EINVAL;
+    pthread_once(&calibrate_once, calibrate);
+
+    uint64_t counts[LATENCY_BUCKETS] = {0};
+    memset(out, 0, sizeof(*out));
+
+    int first = path == LATENCY_ALL ? 0 : path;
+    int last = path == LATENCY_ALL ? LATENCY_PATHS - 1 : path;
+    uint64_t max = 0;
+
+    pthread_mutex_lock(&hist_lock);
+    for (latency_hist_t *h = hists; h; h = h->next) {
+        for (int p = first; p <= last; p++) {
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                counts[b] += __atomic_load_n(&h->counts[p][b], __ATOMIC_RELAXED);
+            }
+            uint64_t m = __atomic_load_n(&h->max[p], __ATOMIC_RELAXED);
+            if (m > max) max = m;
+        }
+    }
+    pthread_mutex_unlock(&hist_lock);
+
+    for (int b = 0; b < LATENCY_BUCKETS; b++) out->count += counts[b];
+
+    // each percentile is the top of the bucket it falls in
+    const uint64_t permille[] = { 500, 990, 999 };
+    uint64_t *dest[] = { &out->p50_ns, &out->p99_ns, &out->p999_ns };
+    uint64_t seen = 0;
+    int next = 0;
+    for (int b = 0; b < LATENCY_BUCKETS && next < 3; b++) {
+        seen += counts[b];
+        while (next < 3 && counts[b] > 0 && seen * 1000 >= out->count * permille[next]) {
+            *dest[next++] = (uint64_t)(bucket_top(b) * ns_per_tick);
+        }
+    }
+    // but never past the largest value actually recorded
+    out->max_ns = (uint64_t)(max * ns_per_tick);
+    for (int i = 0; i < 3; i++) {
+        if (*dest[i] > out->max_ns) *dest[i] = out->max_ns;
+    }
+    return 0;
+}
+
+// counts made meanwhile may survive or be lost
+void alloc_latency_reset(void) {
+    pthread_mutex_lock(&hist_lock);
+    for (latency_hist_t *h = hists; h; h = h->next) {
+        for (int p = 0; p < LATENCY_PATHS; p++) {
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                __atomic_store_n(&h->counts[p][b], 0, __ATOMIC_RELAXED);
+            }
+            __atomic_store_n(&h->max[p], 0, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&hist_lock);
+}
+#else
+int alloc_latency(int path, alloc_latency_t *out) {
+    (void)path;
+    memset(out, 0, sizeof(*out));
+    return ENOSYS;
+}
+
+void alloc_latency_reset(void) {
+}
+#endif
@@ -3,20 +3,21 @@
 
 int main() {
     init_allocator();
+    alloc_set_thread_cache(false);  // free straight into the shared lists
     char *p1 = alloc(40);   // 10 words
     char *p2 = alloc(80);   // 20 words
     char *p3 = alloc(120);  // 30 words
     char *p4 = alloc(160);  // 40 words
     
     printf("=== Initial ===\n");
-    show((header *)memspace);
+    show_heap();
     
     printf("\n=== Free p1, p2, p3 (should coalesce) ===\n");
     dealloc(p1);
     dealloc(p2);
     dealloc(p3);
     
-    show((header *)memspace);
+    show_heap();
 
     
     return 0;
@@ -0,0 +1,186 @@
+#include "alloc.h"
+
+// restartable sequences need the kernel's rseq area, registered by glibc
+// 2.35+, and the x86-64 critical sections below. ThreadSanitizer can't see
+// memory accesses made from inline asm, so sanitized builds go without
+#if defined(__x86_64__) && defined(__linux__) && !defined(__SANITIZE_THREAD__) && \
+    __has_include(<sys/rseq.h>)
+#define HAVE_RSEQ 1
+#include <sys/rseq.h>
+#endif
+
+// one CPU's cache of one size class, a stack of free payload pointers
+typedef struct {
+    uint64_t count;
+    void *slots[PERCPU_CACHE_SIZE];
+} percpu_cache_t;
+
+// ncpus * TOP_CLASS caches, mapped on first use
+static percpu_cache_t *percpu_caches = NULL;
+static int percpu_ncpus = 0;
+#ifdef HAVE_RSEQ
+static pthread_mutex_t percpu_init_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static inline percpu_cache_t *cache_of(int cpu, int size_class) {
+    return &percpu_caches[(size_t)cpu * TOP_CLASS + size_class];
+}
+
+// map the caches if rseq is usable; false leaves the thread caches in charge
+bool percpu_init(void) {
+#ifdef HAVE_RSEQ
+    if (__rseq_size == 0) return false;
+
+    pthread_mutex_lock(&percpu_init_lock);
+    if (percpu_caches == NULL) {
+        int ncpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+        size_t bytes = (size_t)ncpus * TOP_CLASS * sizeof(percpu_cache_t);
+        percpu_caches = heap_map_large(bytes);
+        if (percpu_caches) percpu_ncpus = ncpus;
+    }
+    pthread_mutex_unlock(&percpu_init_lock);
+
+    return percpu_caches != NULL;
+#else
+    return false;
+#endif
+}
+
+#ifdef HAVE_RSEQ
+static inline struct rseq *rseq_area(void) {
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+#endif
+
+// CPU the calling thread runs on, or -1 if it has no rseq registration
+int percpu_cpu(void) {
+#ifdef HAVE_RSEQ
+    int cpu = (int)__atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED);
+    return cpu >= 0 && cpu < percpu_ncpus ? cpu : -1;
+#else
+    return -1;
+#endif
+}
+
+// Each critical section below runs from label 1 up to the committing store
+// just before label 2. If the thread is preempted, migrated or signalled in
+// between, the kernel restarts it at label 4, which reports PERCPU_ABORTED,
+// so nothing is half done. The descriptor (label 3) lives in __rseq_cs, and
+// the abort handler is preceded by RSEQ_SIG as the kernel requires.
+// offsets into struct rseq: cpu_id at 4, rseq_cs at 8
+#define RSEQ_CS_DESCRIPTOR                          \
+    ".pushsection __rseq_cs, \"aw\"\n\t"            \
+    ".balign 32\n\t"                                \
+    "3:\n\t"                                        \
+    ".long 0, 0\n\t"                                \
+    ".quad 1f, 2f - 1f, 4f\n\t"                     \
+    ".popsection\n\t"                               \
+    "leaq 3b(%%rip), %%rax\n\t"                     \
+    "movq %%rax, 8(%[rs])\n\t"
+
+#define RSEQ_ABORT_HANDLER                          \
+    ".pushsection __rseq_failure, \"ax\"\n\t"       \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                    \
+    ".long 0x53053053\n\t"                          \
+    "4:\n\t"                                        \
+    "movl $1, %[status]\n\t"                        \
+    "jmp 6f\n\t"                                    \
+    ".popsection\n\t"
+
+// pop the top of this CPU's cache of a class
+int percpu_pop(int cpu, int size_class, void **item) {
+#ifdef HAVE_RSEQ
+    percpu_cache_t *c = cache_of(cpu, size_class);
+    int status;
+    void *out = NULL;
+
+    __asm__ __volatile__(
+        RSEQ_CS_DESCRIPTOR
+        "1:\n\t"
+        "cmpl %[cpu], 4(%[rs])\n\t"
+        "jnz 4f\n\t"
+        "movq (%[c]), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz 5f\n\t"
+        // slots[count - 1] sits count words past the start of the cache
+        "movq (%[c], %%rcx, 8), %[out]\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%[c])\n\t"
+        "2:\n\t"
+        "movl $0, %[status]\n\t"
+        "jmp 6f\n\t"
+        RSEQ_ABORT_HANDLER
+        "5:\n\t"
+        "movl $2, %[status]\n\t"
+        "6:\n\t"
+        : [status] "=&r"(status), [out] "=&r"(out)
+        : [rs] "r"(rseq_area()), [cpu] "r"(cpu), [c] "r"(c)
+        : "rax", "rcx", "memory", "cc");
+
+    *item = out;
+    return status;
+#else
+    (void)cpu; (void)size_class; (void)item;
+    return PERCPU_EMPTY;
+#endif
+}
+
+// push onto this CPU's cache of a class unless it holds `capacity` already
+int percpu_push(int cpu, int size_class, void *item, int capacity) {
+#ifdef HAVE_RSEQ
+    percpu_cache_t *c = cache_of(cpu, size_class);
+    int status;
+
+    __asm__ __volatile__(
+        RSEQ_CS_DESCRIPTOR
+        "1:\n\t"
+        "cmpl %[cpu], 4(%[rs])\n\t"
+        "jnz 4f\n\t"
+        "movq (%[c]), %%rcx\n\t"
+        "cmpq %[cap], %%rcx\n\t"
+        "jae 5f\n\t"
+        "movq %[item], 8(%[c], %%rcx, 8)\n\t"
+        "incq %%rcx\n\t"
+        "movq %%rcx, (%[c])\n\t"
+        "2:\n\t"
+        "movl $0, %[status]\n\t"
+        "jmp 6f\n\t"
+        RSEQ_ABORT_HANDLER
+        "5:\n\t"
+        "movl $3, %[status]\n\t"
+        "6:\n\t"
+        : [status] "=&r"(status)
+        : [rs] "r"(rseq_area()), [cpu] "r"(cpu), [c] "r"(c),
+          [item] "r"(item), [cap] "r"((uint64_t)capacity)
+        : "rax", "rcx", "memory", "cc");
+
+    return status;
+#else
+    (void)cpu; (void)size_class; (void)item; (void)capacity;
+    return PERCPU_FULL;
+#endif
+}
+
+// empty one CPU's cache of a class into objs, returning how many it held;
+// only safe while no other thread uses the per-CPU caches
+int percpu_take_all(int cpu, int size_class, void **objs) {
+    percpu_cache_t *c = cache_of(cpu, size_class);
+    int n = (int)c->count;
+
+    memcpy(objs, c->slots, n * sizeof(void *));
+    c->count = 0;
+    return n;
+}
+
+int percpu_count(void) {
+    return percpu_ncpus;
+}
+
+// objects of the class cached over all CPUs, read while they change
+size_t percpu_cached(int size_class) {
+    size_t n = 0;
+    for (int cpu = 0; cpu < percpu_ncpus; cpu++) {
+        n += __atomic_load_n(&cache_of(cpu, size_class)->count, __ATOMIC_RELAXED);
+    }
+    return n;
+}
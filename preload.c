@@ -0,0 +1,200 @@
+#include "alloc.h"
+#include <fcntl.h>
+
+// liballoc.so: run an unmodified, dynamically linked program on this
+// allocator with LD_PRELOAD=./liballoc.so. the malloc family and the C++
+// operators new and delete below replace glibc's and libstdc++'s.
+//
+// nothing needs setting up first: segments are mapped on first use, so
+// allocations made while the C library itself is starting are served like
+// any other, and init_allocator() (which would throw the heap away) is
+// never called. everything but these entry points is hidden, so the
+// program's own symbols can't clash with the allocator's
+
+#define export __attribute__((visibility("default")))
+
+// what malloc promises: enough for any fundamental type
+#define MALLOC_ALIGN 16
+
+_Static_assert(MALLOC_ALIGN == ALLOC_ALIGN, "alloc() places rounded requests aligned");
+
+// requests rounded to MALLOC_ALIGN land in slab classes whose objects are
+// all MALLOC_ALIGN aligned, or in blocks and large objects, which always
+// are; 0 gets a unique pointer like in glibc
+static inline size_t round_request(size_t size) {
+    return size == 0 ? MALLOC_ALIGN : (size + MALLOC_ALIGN - 1) & ~(size_t)(MALLOC_ALIGN - 1);
+}
+
+static void *no_memory(void) {
+    errno = ENOMEM;
+    return NULL;
+}
+
+export void *malloc(size_t size) {
+    if (size > UINT32_MAX - MALLOC_ALIGN) return no_memory();
+
+    void *p = alloc((int32)round_request(size));
+    return p ? p : no_memory();
+}
+
+export void free(void *ptr) {
+    dealloc(ptr);
+}
+
+export void *calloc(size_t n, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(n, size, &bytes) || bytes > UINT32_MAX - MALLOC_ALIGN) {
+        return no_memory();
+    }
+
+    void *p = alloc_calloc(1, round_request(bytes));
+    return p ? p : no_memory();
+}
+
+export void *realloc(void *ptr, size_t size) {
+    if (ptr && size == 0) {
+        dealloc(ptr);
+        return NULL;
+    }
+    if (size > UINT32_MAX - MALLOC_ALIGN) return no_memory();
+
+    void *p = alloc_realloc(ptr, round_request(size));
+    return p ? p : no_memory();
+}
+
+export void *reallocarray(void *ptr, size_t n, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(n, size, &bytes)) return no_memory();
+    return realloc(ptr, bytes);
+}
+
+// glibc's memalign rounds odd alignments up to a power of two
+export void *memalign(size_t align, size_t size) {
+    if (align < MALLOC_ALIGN) align = MALLOC_ALIGN;
+    if ((align & (align - 1)) != 0) align = (size_t)1 << (64 - __builtin_clzl(align));
+    if (size > UINT32_MAX - align) return no_memory();
+
+    void *p = alloc_aligned(align, round_request(size));
+    return p ? p : no_memory();
+}
+
+export void *aligned_alloc(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(align, size);
+}
+
+export int posix_memalign(void **out, size_t align, size_t size) {
+    if (align == 0 || align % sizeof(void *) != 0 || (align & (align - 1)) != 0) return EINVAL;
+
+    void *p = memalign(align, size);
+    if (p == NULL) return ENOMEM;
+    *out = p;
+    return 0;
+}
+
+export void *valloc(size_t size) {
+    return memalign(heap_page_size, size);
+}
+
+export void *pvalloc(size_t size) {
+    return memalign(heap_page_size, (size + heap_page_size - 1) & ~(heap_page_size - 1));
+}
+
+export size_t malloc_usable_size(void *ptr) {
+    return alloc_usable_size(ptr);
+}
+
+// glibc's own would describe arenas nothing allocates from; this prints
+// the allocator's statistics as JSON to stderr, without allocating
+export void malloc_stats(void) {
+    char buf[16384];
+    int n = alloc_stats_json(buf, sizeof(buf) - 1);
+    if (n > (int)sizeof(buf) - 2) n = sizeof(buf) - 2;
+    buf[n] = '\n';
+    if (write(STDERR_FILENO, buf, n + 1) < 0) return;
+}
+
+// C++ operators by their Itanium ABI names, since this is C. a failing
+// new can't throw std::bad_alloc from here, so it aborts instead; the
+// nothrow forms return NULL as they should
+static void *new_or_abort(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) abort();
+    return p;
+}
+
+static void *aligned_new_or_abort(size_t size, size_t align) {
+    void *p = memalign(align, size);
+    if (p == NULL) abort();
+    return p;
+}
+
+// operator new(size_t), new[](size_t) and their nothrow forms
+export void *_Znwm(size_t size) { return new_or_abort(size); }
+export void *_Znam(size_t size) { return new_or_abort(size); }
+export void *_ZnwmRKSt9nothrow_t(size_t size, const void *tag) { (void)tag; return malloc(size); }
+export void *_ZnamRKSt9nothrow_t(size_t size, const void *tag) { (void)tag; return malloc(size); }
+
+// aligned new (C++17), with std::align_val_t passed as a size_t
+export void *_ZnwmSt11align_val_t(size_t size, size_t align) {
+    return aligned_new_or_abort(size, align);
+}
+export void *_ZnamSt11align_val_t(size_t size, size_t align) {
+    return aligned_new_or_abort(size, align);
+}
+export void *_ZnwmSt11align_val_tRKSt9nothrow_t(size_t size, size_t align, const void *tag) {
+    (void)tag;
+    return memalign(align, size);
+}
+export void *_ZnamSt11align_val_tRKSt9nothrow_t(size_t size, size_t align, const void *tag) {
+    (void)tag;
+    return memalign(align, size);
+}
+
+// operator delete and delete[], plain, sized (C++14), nothrow and aligned;
+// the sized forms pass the size new rounded it to. aligned objects may sit
+// in blocks whatever their size, so they are freed unsized
+export void _ZdlPv(void *ptr) { dealloc(ptr); }
+export void _ZdaPv(void *ptr) { dealloc(ptr); }
+export void _ZdlPvm(void *ptr, size_t size) { dealloc_sized(ptr, round_request(size)); }
+export void _ZdaPvm(void *ptr, size_t size) { dealloc_sized(ptr, round_request(size)); }
+export void _ZdlPvRKSt9nothrow_t(void *ptr, const void *tag) { (void)tag; dealloc(ptr); }
+export void _ZdaPvRKSt9nothrow_t(void *ptr, const void *tag) { (void)tag; dealloc(ptr); }
+export void _ZdlPvSt11align_val_t(void *ptr, size_t align) { (void)align; dealloc(ptr); }
+export void _ZdaPvSt11align_val_t(void *ptr, size_t align) { (void)align; dealloc(ptr); }
+export void _ZdlPvmSt11align_val_t(void *ptr, size_t size, size_t align) {
+    (void)size; (void)align;
+    dealloc(ptr);
+}
+export void _ZdaPvmSt11align_val_t(void *ptr, size_t size, size_t align) {
+    (void)size; (void)align;
+    dealloc(ptr);
+}
+
+// keep the allocator's locks consistent across fork(), and start the heap
+// profiler if ALLOC_PROFILE_RATE asks for it
+__attribute__((constructor))
+static void preload_init(void) {
+    pthread_atfork(alloc_prefork, alloc_postfork_parent, alloc_postfork_child);
+
+    const char *rate = getenv("ALLOC_PROFILE_RATE");
+    if (rate) alloc_set_profile_rate(strtoull(rate, NULL, 10));
+}
+
+// with ALLOC_PROFILE=prefix set, each process leaves its heap profile in
+// prefix.<pid>.heap when it exits
+__attribute__((destructor))
+static void preload_fini(void) {
+    const char *prefix = getenv("ALLOC_PROFILE");
+    if (prefix == NULL) return;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d.heap", prefix, (int)getpid());
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    alloc_profile_dump(fd);
+    close(fd);
+}
@@ -0,0 +1,245 @@
+#include "alloc.h"
+#include <execinfo.h>
+#include <fcntl.h>
+#include <stdarg.h>
+
+// one sampled allocation site: its call stack, the sampled objects still
+// live and every one sampled there so far
+typedef struct {
+    uint64_t hash;           // 0 while the slot is free
+    int depth;
+    void *frames[PROFILE_DEPTH];
+    uint64_t live_objects;
+    uint64_t live_bytes;
+    uint64_t total_objects;
+    uint64_t total_bytes;
+} profile_stack_t;
+
+// open addressed by the hash of the frames and never shrunk, so a stack id
+// (slot + 1) stays valid as long as the process runs; mapped on first use.
+// once every slot is taken, samples from new sites are not recorded
+static profile_stack_t *stacks = NULL;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// mean bytes between samples, 0 when the profiler is off
+static atomic_size_t profile_rate = 0;
+
+__thread long profile_countdown = 0;
+static __thread uint64_t profile_rng = 0;
+static __thread bool profiling = false;
+
+// xorshift64*, seeded per thread from its TLS address and the clock
+static uint64_t next_random(void) {
+    if (profile_rng == 0) {
+        profile_rng = (uintptr_t)&profile_rng ^ ((uint64_t)now_ms() << 32) ^ 0x9e3779b97f4a7c15ull;
+    }
+    profile_rng ^= profile_rng >> 12;
+    profile_rng ^= profile_rng << 25;
+    profile_rng ^= profile_rng >> 27;
+    return profile_rng * 0x2545f4914f6cdd1dull;
+}
+
+// log2 of q in [1, 2^53): the exponent plus a quadratic fit of the
+// mantissa's log, within 0.005 of the real thing, which is plenty for
+// spacing samples and saves pulling in libm
+static double approx_log2(uint64_t q) {
+    int e = 63 - __builtin_clzll(q);
+    double m = (double)q / (double)(1ull << e);
+    return e + (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+}
+
+// bytes until the next sample, drawn from an exponential distribution with
+// the given mean so that samples are a Poisson process over bytes allocated
+static long next_interval(size_t rate) {
+    uint64_t q = (next_random() >> 11) + 1;
+    double interval = (53 - approx_log2(q)) * 0.6931471805599453 * (double)rate;
+    return interval < 1 ? 1 : (long)interval;
+}
+
+// the countdown ran out: true if this allocation is to be sampled. a
+// thread's countdown starts at 0, and while the profiler is off it is set
+// PROFILE_IDLE_BYTES ahead, so turning it on reaches every thread soon
+bool profile_due(void) {
+    size_t rate = atomic_load_explicit(&profile_rate, memory_order_relaxed);
+    if (rate == 0) {
+        profile_countdown = PROFILE_IDLE_BYTES;
+        return false;
+    }
+    profile_countdown = next_interval(rate);
+    return !profiling;
+}
+
+static uint64_t hash_frames(void **frames, int depth) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < depth; i++) {
+        h = (h ^ (uintptr_t)frames[i]) * 0x100000001b3ull;
+    }
+    return h ? h : 1;
+}
+
+// take the calling stack for a sampled allocation of `bytes`, skipping the
+// allocator's own frames; returns its stack id, or 0 if it isn't recorded
+word profile_record(size_t bytes, int skip) {
+    void *frames[PROFILE_DEPTH + PROFILE_SKIP_MAX];
+
+    // backtrace() may allocate the first time it runs; those allocations
+    // must not be sampled in turn
+    profiling = true;
+    int depth = backtrace(frames, PROFILE_DEPTH + skip) - skip;
+    profiling = false;
+    if (depth <= 0) return 0;
+
+    uint64_t h = hash_frames(frames + skip, depth);
+    word id = 0;
+
+    pthread_mutex_lock(&profile_lock);
+    if (stacks) {
+        for (int probe = 0; probe < PROFILE_STACKS; probe++) {
+            int slot = (int)((h + probe) & (PROFILE_STACKS - 1));
+            profile_stack_t *s = &stacks[slot];
+
+            if (s->hash == 0) {
+                s->hash = h;
+                s->depth = depth;
+                memcpy(s->frames, frames + skip, depth * sizeof(void *));
+            } else if (s->hash != h || s->depth != depth ||
+                       memcmp(s->frames, frames + skip, depth * sizeof(void *)) != 0) {
+                continue;
+            }
+
+            s->live_objects++;
+            s->live_bytes += bytes;
+            s->total_objects++;
+            s->total_bytes += bytes;
+            id = slot + 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    return id;
+}
+
+// a sampled object was freed
+void profile_release(word id, size_t bytes) {
+    pthread_mutex_lock(&profile_lock);
+    profile_stack_t *s = &stacks[id - 1];
+    s->live_objects--;
+    s->live_bytes -= bytes;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+int alloc_set_profile_rate(size_t bytes) {
+    if (bytes > 0) {
+        pthread_mutex_lock(&profile_lock);
+        if (stacks == NULL) stacks = heap_map_large(PROFILE_STACKS * sizeof(profile_stack_t));
+        bool mapped = stacks != NULL;
+        pthread_mutex_unlock(&profile_lock);
+        if (!mapped) return ENOMEM;
+
+        // load whatever backtrace() loads lazily now, rather than mid-sample
+        void *frame;
+        backtrace(&frame, 1);
+    }
+
+    atomic_store(&profile_rate, bytes);
+    profile_countdown = 0;
+    return 0;
+}
+
+// buffered write(2): stdio would allocate, and the dump may run in a
+// process whose malloc is this allocator
+typedef struct {
+    int fd;
+    int err;
+    size_t len;
+    char buf[8192];
+} dump_t;
+
+static void dump_flush(dump_t *d) {
+    for (size_t off = 0; off < d->len && d->err == 0;) {
+        ssize_t n = write(d->fd, d->buf + off, d->len - off);
+        if (n < 0 && errno != EINTR) d->err = errno;
+        if (n > 0) off += n;
+    }
+    d->len = 0;
+}
+
+static void dump_printf(dump_t *d, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// every piece written is far shorter than the room kept free
+static void dump_printf(dump_t *d, const char *fmt, ...) {
+    if (sizeof(d->buf) - d->len < 1024) dump_flush(d);
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(d->buf + d->len, sizeof(d->buf) - d->len, fmt, ap);
+    va_end(ap);
+    if (n > 0) d->len += n;
+}
+
+// counts of the sites a line is written for: live objects and bytes, then
+// everything sampled, as heap profiles give them
+static void dump_counts(dump_t *d, uint64_t lo, uint64_t lb, uint64_t to, uint64_t tb) {
+    dump_printf(d, "%6llu: %8llu [%6llu: %8llu] @",
+                (unsigned long long)lo, (unsigned long long)lb,
+                (unsigned long long)to, (unsigned long long)tb);
+}
+
+// the gperftools heap profile text format, which pprof reads: a header
+// with the totals and the sampling rate, one line per call site, then the
+// process's mappings so addresses can be symbolized. pprof scales the
+// sampled counts back up by the rate itself
+int alloc_profile_dump(int fd) {
+    dump_t d = { .fd = fd };
+    uint64_t lo = 0, lb = 0, to = 0, tb = 0;
+
+    pthread_mutex_lock(&profile_lock);
+    profile_stack_t *table = stacks;
+    for (int i = 0; table && i < PROFILE_STACKS; i++) {
+        lo += table[i].live_objects;
+        lb += table[i].live_bytes;
+        to += table[i].total_objects;
+        tb += table[i].total_bytes;
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    dump_printf(&d, "heap profile: ");
+    dump_counts(&d, lo, lb, to, tb);
+    dump_printf(&d, " heap_v2/%zu\n", atomic_load(&profile_rate));
+
+    // sites are copied out one at a time, so sampling carries on meanwhile
+    for (int i = 0; table && i < PROFILE_STACKS; i++) {
+        pthread_mutex_lock(&profile_lock);
+        profile_stack_t s = table[i];
+        pthread_mutex_unlock(&profile_lock);
+        if (s.hash == 0) continue;
+
+        dump_counts(&d, s.live_objects, s.live_bytes, s.total_objects, s.total_bytes);
+        for (int f = 0; f < s.depth; f++) dump_printf(&d, " %p", s.frames[f]);
+        dump_printf(&d, "\n");
+    }
+
+    dump_printf(&d, "\nMAPPED_LIBRARIES:\n");
+    dump_flush(&d);
+
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        ssize_t n;
+        while (d.err == 0 && (n = read(maps, d.buf, sizeof(d.buf))) > 0) {
+            d.len = n;
+            dump_flush(&d);
+        }
+        close(maps);
+    }
+    return d.err;
+}
+
+// hold the stack table still across fork()
+void profile_lock_all(void) {
+    pthread_mutex_lock(&profile_lock);
+}
+
+void profile_unlock_all(void) {
+    pthread_mutex_unlock(&profile_lock);
+}
@@ -0,0 +1,242 @@
+#include "alloc.h"
+
+// objects start after the slab header, 16-byte aligned
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + 15) & ~(size_t)15)
+#define SLAB_OBJECTS(slab) ((char *)(slab) + SLAB_HEADER_SIZE)
+
+// slabs of each class with at least one free object; full slabs are on no
+// list and come back when one of their objects is returned
+static slab_t *partial_slabs[SLAB_MAX_CLASS + 1] = {NULL};
+
+static pthread_mutex_t slab_locks[SLAB_MAX_CLASS + 1] = {
+    [0 ... SLAB_MAX_CLASS] = PTHREAD_MUTEX_INITIALIZER
+};
+
+// objects in the slabs each class holds and how many of them are out,
+// kept under the class's lock
+static size_t class_objects[SLAB_MAX_CLASS + 1];
+static size_t class_used[SLAB_MAX_CLASS + 1];
+
+// empty slabs shared by all classes, and the part of the current slab
+// segment not carved into slabs yet
+static slab_t *empty_slabs = NULL;
+static char *slab_top = NULL;
+static char *slab_end = NULL;
+static size_t pooled_slabs = 0;
+static pthread_mutex_t slab_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// get an empty slab from the pool or from fresh slab segment memory
+static slab_t *new_slab(int size_class) {
+    pthread_mutex_lock(&slab_pool_lock);
+
+    slab_t *slab = empty_slabs;
+    if (slab) {
+        empty_slabs = slab->next;
+        pooled_slabs--;
+    } else {
+        if (slab_top == slab_end) {
+            segment_t *seg = heap_map_segment(SEGMENT_SIZE, SEGMENT_SLABS, 0);
+            if (seg) {
+                slab_top = seg->base;
+                slab_end = seg->base + seg->size;
+            }
+        }
+        if (slab_top != slab_end) {
+            slab = (slab_t *)slab_top;
+            slab_top += SLAB_SIZE;
+        }
+    }
+
+    pthread_mutex_unlock(&slab_pool_lock);
+    if (slab == NULL) return NULL;
+
+    word size = SIZE_CLASS_LIMITS[size_class] * sizeof(word);
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->free = NULL;
+    slab->size_class = size_class;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / size;
+    slab->bump = 0;
+    slab->used = 0;
+    slab->freed_at = 0;
+    slab->owner = 0;
+    return slab;
+}
+
+// link a slab at the head of its class's partial list (assumes caller holds the lock)
+static void link_partial(slab_t *slab) {
+    slab_t *head = partial_slabs[slab->size_class];
+    slab->prev = NULL;
+    slab->next = head;
+    if (head) head->prev = slab;
+    partial_slabs[slab->size_class] = slab;
+}
+
+static void unlink_partial(slab_t *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        partial_slabs[slab->size_class] = slab->next;
+    }
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+// fill objs with up to n objects of the class for the thread heap `owner`;
+// returns how many it got, fewer than n only when the heap is exhausted
+int slab_take(int size_class, void **objs, int n, word owner) {
+    word size = SIZE_CLASS_LIMITS[size_class] * sizeof(word);
+    int got = 0;
+
+    pthread_mutex_lock(&slab_locks[size_class]);
+
+    while (got < n) {
+        slab_t *slab = partial_slabs[size_class];
+        if (slab == NULL) {
+            slab = new_slab(size_class);
+            if (slab == NULL) break;
+            link_partial(slab);
+            class_objects[size_class] += slab->capacity;
+        }
+
+        // frees from other threads are sent to whoever allocates here now
+        __atomic_store_n(&slab->owner, owner, __ATOMIC_RELAXED);
+
+        while (got < n && slab->used < slab->capacity) {
+            void *obj = slab->free;
+            if (obj) {
+                slab->free = *(void **)obj;
+            } else {
+                obj = SLAB_OBJECTS(slab) + (size_t)slab->bump++ * size;
+            }
+            slab->used++;
+            objs[got++] = obj;
+        }
+
+        if (slab->used == slab->capacity) unlink_partial(slab);
+    }
+    class_used[size_class] += got;
+
+    pthread_mutex_unlock(&slab_locks[size_class]);
+    return got;
+}
+
+// give n objects of the class back to their slabs; a slab that empties goes
+// to the shared pool unless it is the last partial slab of its class
+void slab_return(int size_class, void **objs, int n) {
+    slab_t *released = NULL;
+
+    pthread_mutex_lock(&slab_locks[size_class]);
+
+    for (int i = 0; i < n; i++) {
+        slab_t *slab = SLAB_OF(objs[i]);
+
+        if (slab->used == slab->capacity) link_partial(slab);
+
+        *(void **)objs[i] = slab->free;
+        slab->free = objs[i];
+        slab->used--;
+
+        if (slab->used == 0 && (slab->prev || slab->next)) {
+            unlink_partial(slab);
+            slab->next = released;
+            released = slab;
+            class_objects[size_class] -= slab->capacity;
+        }
+    }
+    class_used[size_class] -= n;
+
+    pthread_mutex_unlock(&slab_locks[size_class]);
+
+    if (released == NULL) return;
+
+    word now = now_ms();
+    pthread_mutex_lock(&slab_pool_lock);
+    while (released) {
+        slab_t *slab = released;
+        released = slab->next;
+        slab->freed_at = now;
+        slab->next = empty_slabs;
+        empty_slabs = slab;
+        pooled_slabs++;
+    }
+    pthread_mutex_unlock(&slab_pool_lock);
+}
+
+// madvise away everything but the header page of pooled slabs that have been
+// empty for the decay time, or of every pooled slab if `all` is set
+void slab_purge(word now, word decay, bool all) {
+    pthread_mutex_lock(&slab_pool_lock);
+
+    for (slab_t *slab = empty_slabs; slab; slab = slab->next) {
+        if (slab->freed_at == 0) continue;
+        if (!all && now - slab->freed_at < decay) continue;
+
+        heap_purge(slab + 1, SLAB_SIZE - sizeof(slab_t));
+        slab->freed_at = 0;
+    }
+
+    pthread_mutex_unlock(&slab_pool_lock);
+}
+
+// forget every slab; the segments themselves are dropped by heap_reset
+void slab_reset(void) {
+    pthread_mutex_lock(&slab_pool_lock);
+    empty_slabs = NULL;
+    slab_top = NULL;
+    slab_end = NULL;
+    pooled_slabs = 0;
+    pthread_mutex_unlock(&slab_pool_lock);
+
+    for (int i = 0; i <= SLAB_MAX_CLASS; i++) {
+        pthread_mutex_lock(&slab_locks[i]);
+        partial_slabs[i] = NULL;
+        class_objects[i] = class_used[i] = 0;
+        pthread_mutex_unlock(&slab_locks[i]);
+    }
+}
+
+// hold every slab lock across fork(), in the order slab_take nests them
+void slab_lock_all(void) {
+    for (int i = 0; i <= SLAB_MAX_CLASS; i++) {
+        pthread_mutex_lock(&slab_locks[i]);
+    }
+    pthread_mutex_lock(&slab_pool_lock);
+}
+
+void slab_unlock_all(void) {
+    pthread_mutex_unlock(&slab_pool_lock);
+    for (int i = SLAB_MAX_CLASS; i >= 0; i--) {
+        pthread_mutex_unlock(&slab_locks[i]);
+    }
+}
+
+// objects in the class's slabs, and how many are allocated or cached
+void slab_usage(int size_class, size_t *objects, size_t *used) {
+    pthread_mutex_lock(&slab_locks[size_class]);
+    *objects = class_objects[size_class];
+    *used = class_used[size_class];
+    pthread_mutex_unlock(&slab_locks[size_class]);
+}
+
+// empty slabs in the pool and slab segment memory not carved yet
+size_t slab_pool_bytes(void) {
+    pthread_mutex_lock(&slab_pool_lock);
+    size_t bytes = pooled_slabs * SLAB_SIZE + (size_t)(slab_end - slab_top);
+    pthread_mutex_unlock(&slab_pool_lock);
+    return bytes;
+}
+
+// carved slabs have a non-zero capacity; the rest of the segment is untouched
+void show_slabs(segment_t *seg) {
+    int32 n = 1;
+
+    for (char *p = seg->base; p < seg->base + seg->size; p += SLAB_SIZE) {
+        slab_t *slab = (slab_t *)p;
+        if (slab->capacity == 0) break;
+
+        printf("Slab %d: class %u, %u/%u objects in use at %p\n",
+               n, slab->size_class, slab->used, slab->capacity, (void *)slab);
+        n++;
+    }
+}
@@ -0,0 +1,193 @@
+#include "alloc.h"
+
+#define STAT_FIELDS (sizeof(alloc_class_stats_t) / sizeof(uint64_t))
+
+_Static_assert(sizeof(alloc_class_stats_t) % sizeof(uint64_t) == 0,
+               "counters are summed field by field");
+
+// one slot per thread heap id; the owner is the only writer of its slot
+// (bar slot 0), readers load the counters atomically and may see a count
+// or two that is a moment old
+thread_stats_t thread_stats[MAX_THREAD_HEAPS + 1];
+
+// counts of threads that have exited, and how many still count on their own
+static alloc_class_stats_t retired[NUM_SIZE_CLASSES + 1];
+static int live_threads = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_counters(alloc_class_stats_t *to, alloc_class_stats_t *from) {
+    uint64_t *t = (uint64_t *)to, *f = (uint64_t *)from;
+    for (size_t i = 0; i < STAT_FIELDS; i++) {
+        t[i] += __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+    }
+}
+
+static void clear_counters(alloc_class_stats_t *c) {
+    uint64_t *f = (uint64_t *)c;
+    for (size_t i = 0; i < STAT_FIELDS; i++) {
+        __atomic_store_n(&f[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+// slab classes count objects only; every one is the class's size
+static void add_slab_bytes(alloc_stats_t *stats) {
+    for (int i = 0; i <= SLAB_MAX_CLASS; i++) {
+        alloc_class_stats_t *c = &stats->classes[i];
+        uint64_t size = CLASS_BYTES(i);
+        c->alloc_bytes = c->allocs * size;
+        c->free_bytes = c->frees * size;
+        stats->total.alloc_bytes += c->alloc_bytes;
+        stats->total.free_bytes += c->free_bytes;
+    }
+}
+
+// a thread got a heap id, and with it a slot
+void stats_attach(void) {
+    pthread_mutex_lock(&stats_lock);
+    live_threads++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// fold an exiting thread's slot into the retired counts and clear it for
+// whoever gets the heap id next
+void stats_detach(thread_stats_t *slot) {
+    pthread_mutex_lock(&stats_lock);
+    for (int i = 0; i <= NUM_SIZE_CLASSES; i++) {
+        add_counters(&retired[i], &slot->classes[i]);
+        clear_counters(&slot->classes[i]);
+    }
+    live_threads--;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// the counters of one slot, summed into the classes and total
+void stats_collect(thread_stats_t *slot, alloc_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i <= NUM_SIZE_CLASSES; i++) {
+        add_counters(&stats->classes[i], &slot->classes[i]);
+        add_counters(&stats->total, &slot->classes[i]);
+    }
+    add_slab_bytes(stats);
+    stats->active_bytes = stats->total.alloc_bytes - stats->total.free_bytes;
+    stats->threads = 1;
+}
+
+// init_allocator() starts counting from zero along with the heap
+void stats_reset(void) {
+    pthread_mutex_lock(&stats_lock);
+    for (int i = 0; i <= NUM_SIZE_CLASSES; i++) {
+        clear_counters(&retired[i]);
+        for (int t = 0; t <= MAX_THREAD_HEAPS; t++) {
+            clear_counters(&thread_stats[t].classes[i]);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void alloc_stats(alloc_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    // under the lock a slot is either live or already folded into retired
+    pthread_mutex_lock(&stats_lock);
+    for (int i = 0; i <= NUM_SIZE_CLASSES; i++) {
+        alloc_class_stats_t *c = &stats->classes[i];
+        *c = retired[i];
+        for (int t = 0; t <= MAX_THREAD_HEAPS; t++) {
+            add_counters(c, &thread_stats[t].classes[i]);
+        }
+        add_counters(&stats->total, c);
+    }
+    stats->threads = live_threads;
+    pthread_mutex_unlock(&stats_lock);
+    add_slab_bytes(stats);
+
+    // an object freed by another thread than the one that allocated it is
+    // counted by each, so only the sum over threads balances
+    stats->active_bytes = stats->total.alloc_bytes - stats->total.free_bytes;
+    stats->segment_bytes = heap_segment_bytes();
+    stats->large_bytes = heap_large_bytes();
+}
+
+// append to buf like snprintf, tracking the length the whole output needs
+#define APPEND(...) \
+    (pos += snprintf(buf + (pos < len ? pos : len), pos < len ? len - pos : 0, __VA_ARGS__))
+
+static size_t append_counters(char *buf, size_t len, size_t pos, alloc_class_stats_t *c) {
+    APPEND("\"allocs\":%llu,\"frees\":%llu,\"alloc_bytes\":%llu,\"free_bytes\":%llu,"
+           "\"cache_hits\":%llu,\"cache_misses\":%llu,\"refills\":%llu,\"flushes\":%llu,"
+           "\"lock_waits\":%llu",
+           (unsigned long long)c->allocs, (unsigned long long)c->frees,
+           (unsigned long long)c->alloc_bytes, (unsigned long long)c->free_bytes,
+           (unsigned long long)c->cache_hits, (unsigned long long)c->cache_misses,
+           (unsigned long long)c->refills, (unsigned long long)c->flushes,
+           (unsigned long long)c->lock_waits);
+    return pos;
+}
+
+// the largest object a class holds, 0 for large objects
+static size_t class_size(int i) {
+    return i == STATS_LARGE ? 0
+         : i == TOP_CLASS ? LARGE_THRESHOLD
+         : CLASS_BYTES(i);
+}
+
+// classes that saw no activity are left out
+int alloc_stats_json(char *buf, size_t len) {
+    alloc_stats_t stats;
+    alloc_stats(&stats);
+    size_t pos = 0;
+
+    APPEND("{\"segment_bytes\":%zu,\"large_bytes\":%zu,\"active_bytes\":%zu,\"threads\":%d,"
+           "\"total\":{", stats.segment_bytes, stats.large_bytes, stats.active_bytes,
+           stats.threads);
+    pos = append_counters(buf, len, pos, &stats.total);
+    APPEND("},\"classes\":[");
+
+    bool first = true;
+    for (int i = 0; i <= NUM_SIZE_CLASSES; i++) {
+        alloc_class_stats_t *c = &stats.classes[i];
+        if (c->allocs == 0 && c->frees == 0 && c->lock_waits == 0) continue;
+
+        APPEND("%s{\"class\":%d,\"size\":%zu,", first ? "" : ",", i, class_size(i));
+        pos = append_counters(buf, len, pos, c);
+        APPEND("}");
+        first = false;
+    }
+    APPEND("]}");
+
+    return (int)pos;
+}
+
+// classes holding nothing are left out
+int alloc_heap_report_json(char *buf, size_t len) {
+    alloc_heap_report_t r;
+    alloc_heap_report(&r);
+    size_t pos = 0;
+
+    APPEND("{\"block_bytes\":%zu,\"slab_bytes\":%zu,\"live_bytes\":%zu,"
+           "\"free_list_bytes\":%zu,\"fragment_bytes\":%zu,\"unclaimed_bytes\":%zu,"
+           "\"largest_free\":%zu,\"slab_free_bytes\":%zu,\"slab_pool_bytes\":%zu,"
+           "\"thread_cache_bytes\":%zu,\"percpu_cache_bytes\":%zu,\"transfer_cache_bytes\":%zu,"
+           "\"fragmentation\":%.4f,\"utilization\":%.4f,\"classes\":[",
+           r.block_bytes, r.slab_bytes, r.live_bytes, r.free_list_bytes, r.fragment_bytes,
+           r.unclaimed_bytes, r.largest_free, r.slab_free_bytes, r.slab_pool_bytes,
+           r.thread_cache_bytes, r.percpu_cache_bytes, r.transfer_cache_bytes, r.fragmentation,
+           r.utilization);
+
+    bool first = true;
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++) {
+        alloc_heap_class_t *c = &r.classes[i];
+        if (c->live_objects == 0 && c->free_objects == 0 && c->cached_objects == 0) continue;
+
+        APPEND("%s{\"class\":%d,\"size\":%zu,\"live\":%llu,\"live_bytes\":%llu,"
+               "\"free\":%llu,\"free_bytes\":%llu,\"cached\":%llu,\"cached_bytes\":%llu}",
+               first ? "" : ",", i, class_size(i),
+               (unsigned long long)c->live_objects, (unsigned long long)c->live_bytes,
+               (unsigned long long)c->free_objects, (unsigned long long)c->free_bytes,
+               (unsigned long long)c->cached_objects, (unsigned long long)c->cached_bytes);
+        first = false;
+    }
+    APPEND("]}");
+
+    return (int)pos;
+}
@@ -2,6 +2,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
 
 // helper to get header from pointer
 header *get_header(void *ptr) {
@@ -9,78 +14,81 @@ header *get_header(void *ptr) {
 }
 
 
+// blocks with headers start above the slab classes, so these use sizes
+// between 1 KiB and 16 KiB
 void test_multiple_allocations() {
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
-    char *p1 = alloc(40);
-    char *p2 = alloc(80);
-    char *p3 = alloc(120);
+    char *p1 = alloc(5120);
+    char *p2 = alloc(6144);
+    char *p3 = alloc(8192);
 
     assert(p1 != NULL && p2 != NULL && p3 != NULL);
     assert(p2 > p1 && p3 > p2);
 
-    // diff should be 40 bytes data + HEADER_SIZE + FOOTER_SIZE
+    // diff should be 5120 bytes data, rounded so the next payload is
+    // ALLOC_ALIGN aligned, + HEADER_SIZE
     ptrdiff_t diff = (char *)p2 - (char *)p1;
-    ptrdiff_t expected_diff = 40 + HEADER_SIZE + FOOTER_SIZE;
+    ptrdiff_t expected_diff = 5128 + HEADER_SIZE;
+    assert((uintptr_t)p1 % ALLOC_ALIGN == 0 && (uintptr_t)p2 % ALLOC_ALIGN == 0);
     assert(diff == expected_diff);
 }
 
 void test_free_and_reuse() {
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
-    char *p1 = alloc(40);
-    char *p2 = alloc(80);
-    char *p3 = alloc(120);
+    alloc_set_thread_cache(false);
+    char *p1 = alloc(5120);
+    char *p2 = alloc(6144);
+    char *p3 = alloc(8192);
     (void) p1;
     (void) p3;
     dealloc(p2);
 
     header *h2 = get_header(p2);
-    assert(atomic_load(&h2->alloced) == false);
+    assert(block_alloced(h2) == false);
 
-    char *p4 = alloc(60);
+    char *p4 = alloc(5600);
     assert(p4 == p2);
-    assert(atomic_load(&h2->alloced) == true);
+    assert(block_alloced(h2) == true);
 }
 
 void test_forward_coalesce() {
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
-    char *p1 = alloc(40);
-    char *p2 = alloc(80);
-    char *p3 = alloc(120);
+    alloc_set_thread_cache(false);
+    char *p1 = alloc(5120);
+    char *p2 = alloc(6144);
+    char *p3 = alloc(8192);
     (void) p1;
     dealloc(p2);
     dealloc(p3);
 
     header *h2 = get_header(p2);
-    assert(atomic_load(&h2->w) == 55);
-    assert(atomic_load(&h2->alloced) == false);
+    assert(block_words(h2) == 3590);
+    assert(block_alloced(h2) == false);
 }
 
 void test_backward_coalesce() {
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
-    char *p1 = alloc(40);
-    char *p2 = alloc(80);
-    char *p3 = alloc(120);
+    alloc_set_thread_cache(false);
+    char *p1 = alloc(5120);
+    char *p2 = alloc(6144);
+    char *p3 = alloc(8192);
     (void) p3;
 
     dealloc(p2);
     dealloc(p1);
 
     header *h1 = get_header(p1);
-    assert(atomic_load(&h1->w) == 35);
-    assert(atomic_load(&h1->alloced) == false);
+    assert(block_words(h1) == 2822);
+    assert(block_alloced(h1) == false);
 }
 
 void test_full_coalesce() {
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
-    char *p1 = alloc(40);
-    char *p2 = alloc(80);
-    char *p3 = alloc(120);
-    char *p4 = alloc(160);
+    alloc_set_thread_cache(false);
+    char *p1 = alloc(5120);
+    char *p2 = alloc(6144);
+    char *p3 = alloc(8192);
+    char *p4 = alloc(10240);
     (void) p4;
 
     dealloc(p1);
@@ -88,12 +96,742 @@ void test_full_coalesce() {
     dealloc(p3);
 
     header *h1 = get_header(p1);
-    assert(atomic_load(&h1->w) == 70);
-    assert(atomic_load(&h1->alloced) == false);
+    assert(block_words(h1) == 4874);
+    assert(block_alloced(h1) == false);
+}
+
+void test_unlink_from_middle() {
+    init_allocator();
+    alloc_set_thread_cache(false);
+
+    char *a = alloc(5120);
+    char *x1 = alloc(5120);
+    char *b = alloc(5120);
+    char *x2 = alloc(5120);
+    char *c = alloc(5120);
+    char *x3 = alloc(5120);
+    (void) x2;
+    (void) x3;
+
+    // the 1280-word list is now c -> b -> a
+    dealloc(a);
+    dealloc(b);
+    dealloc(c);
+
+    // x1 merges with b (middle of the list) and a (its tail)
+    dealloc(x1);
+    header *ha = get_header(a);
+    assert(block_words(ha) == 3850);
+
+    // c is still reachable, and the merged block serves the next request
+    char *next = alloc(5120);
+    assert(next == c);
+    next = alloc(5120);
+    assert(next == a);
+    (void)next;
+}
+
+// 1536-byte blocks (386 words, rounded to keep payloads aligned) move in
+// batches of 32, and a cache that missed on every allocation has grown to
+// THREAD_CACHE_SIZE by the time it is freed into
+#define BATCHED_SIZE 1536
+#define BATCHED_WORDS 386
+#define FLUSHED_FIRST (THREAD_CACHE_SIZE - TRANSFER_BATCH)
+
+void test_flush_coalesces() {
+    init_allocator();
+
+    // adjacent blocks, one more than the cache holds, all in one span
+    char *ptrs[THREAD_CACHE_SIZE + 1];
+    for (int i = 0; i <= THREAD_CACHE_SIZE; i++) {
+        ptrs[i] = alloc(BATCHED_SIZE);
+    }
+
+    // the last free flushes the newest batch of the cache, and a purge pass
+    // hands the batch back to the lists, which coalesces it
+    for (int i = 0; i <= THREAD_CACHE_SIZE; i++) {
+        dealloc(ptrs[i]);
+    }
+    alloc_purge();
+
+    header *h = get_header(ptrs[FLUSHED_FIRST]);
+    assert(block_words(h) ==
+           (word)(TRANSFER_BATCH * BATCHED_WORDS + (TRANSFER_BATCH - 1) * OVERHEAD / 4));
+    assert(block_listed(h) == true);
+
+    // the older blocks are still cached, so they were left alone
+    assert(block_words(get_header(ptrs[FLUSHED_FIRST - 1])) == BATCHED_WORDS);
+}
+
+static void *alloc_batched(void *arg) {
+    (void)arg;
+    return alloc(BATCHED_SIZE);
+}
+
+void test_transfer_cache() {
+    init_allocator();
+    alloc_set_decay_ms(-1);
+
+    char *ptrs[THREAD_CACHE_SIZE + 1];
+    for (int i = 0; i <= THREAD_CACHE_SIZE; i++) {
+        ptrs[i] = alloc(BATCHED_SIZE);
+    }
+    for (int i = 0; i <= THREAD_CACHE_SIZE; i++) {
+        dealloc(ptrs[i]);
+    }
+
+    // the flushed batch is parked without touching the lists
+    for (int i = FLUSHED_FIRST; i < THREAD_CACHE_SIZE; i++) {
+        assert(block_listed(get_header(ptrs[i])) == false);
+    }
+
+    // and another thread's empty cache takes the whole batch
+    pthread_t t;
+    void *p;
+    pthread_create(&t, NULL, alloc_batched, NULL);
+    pthread_join(t, &p);
+
+    bool from_batch = false;
+    for (int i = FLUSHED_FIRST; i < THREAD_CACHE_SIZE; i++) {
+        from_batch |= (p == ptrs[i]);
+    }
+    assert(from_batch);
+
+    alloc_set_decay_ms(PURGE_DECAY_MS);
+}
+
+static void *alloc_many_small(void *arg) {
+    char **ptrs = arg;
+    for (int i = 0; i < 2000; i++) {
+        ptrs[i] = alloc(16);
+    }
+    return NULL;
+}
+
+void test_adaptive_cache() {
+    init_allocator();
+
+    // 16 bytes is class 1; allocating a lot of them misses until the cache
+    // is as deep as it gets
+    static char *ptrs[2000];
+    for (int i = 0; i < 500; i++) ptrs[i] = alloc(16);
+    assert(thread_caches[1].capacity == THREAD_CACHE_SIZE);
+    for (int i = 0; i < 500; i++) dealloc(ptrs[i]);
+
+    // only freeing what another thread allocated keeps overflowing the
+    // cache, which shrinks back to a single batch
+    pthread_t t;
+    pthread_create(&t, NULL, alloc_many_small, ptrs);
+    pthread_join(t, NULL);
+    for (int i = 0; i < 2000; i++) dealloc(ptrs[i]);
+    assert(thread_caches[1].capacity == TRANSFER_BATCH);
+
+    // a big class starts with, and grows by, a smaller batch
+    char *p = alloc(16000);
+    dealloc(p);
+    assert(thread_caches[39].capacity == BATCH_BYTES / 16384);
+}
+
+void test_span_retire() {
+    init_allocator();
+
+    // two top class blocks fill most of the first span; each is rounded to
+    // keep the payload after it aligned
+    char *p1 = alloc(100000);
+    char *p2 = alloc(100000);
+    assert(p2 == p1 + 100008 + OVERHEAD);
+
+    // the third doesn't fit, so the rest of the span becomes a free block
+    char *p3 = alloc(100000);
+    header *rest = GET_NEXT_HEADER(get_header(p2));
+    assert(p3 != NULL);
+    assert(block_listed(rest) == true);
+    assert(block_alloced(rest) == false);
+    assert((char *)GET_NEXT_HEADER(rest) == (char *)get_header(p1) + SPAN_SIZE);
+}
+
+// leaves a small object and some blocks in this thread's cache
+static void *alloc_free_and_exit(void *arg) {
+    char **ptrs = arg;
+    for (int i = 0; i < 4; i++) {
+        ptrs[i] = alloc(5120);
+    }
+    ptrs[4] = alloc(16);
+    for (int i = 0; i < 5; i++) {
+        dealloc(ptrs[i]);
+    }
+    return NULL;
+}
+
+void test_thread_exit_flush() {
+    init_allocator();
+
+    // a thread's cache is handed back when it exits
+    char *ptrs[5];
+    pthread_t t;
+    pthread_create(&t, NULL, alloc_free_and_exit, ptrs);
+    pthread_join(t, NULL);
+
+    header *h = get_header(ptrs[0]);
+    assert(block_listed(h) == true);
+    assert(block_words(h) >= 4 * 1280);
+    assert(SLAB_OF(ptrs[4])->used == 0);
+
+    // and alloc_thread_flush() does the same on demand
+    char *p = alloc(5120);
+    dealloc(p);
+    assert(block_listed(get_header(p)) == false);
+    alloc_thread_flush();
+    assert(block_listed(get_header(p)) == true);
+}
+
+typedef struct {
+    pthread_barrier_t handed_over;
+    pthread_barrier_t freed;
+    char *ptrs[100];
+    bool got_back;
+} producer_arg;
+
+// allocates messages for another thread, then checks it gets them back
+static void *producer(void *arg) {
+    producer_arg *pa = arg;
+    for (int i = 0; i < 100; i++) {
+        pa->ptrs[i] = alloc(64);
+    }
+    pthread_barrier_wait(&pa->handed_over);
+    pthread_barrier_wait(&pa->freed);
+
+    // once its cache runs dry the producer drains the remote frees
+    for (int n = 0; n < 1000 && !pa->got_back; n++) {
+        char *p = alloc(64);
+        for (int i = 0; i < 100; i++) {
+            pa->got_back |= (p == pa->ptrs[i]);
+        }
+    }
+    return NULL;
+}
+
+void test_remote_free() {
+    init_allocator();
+
+    producer_arg pa = { .got_back = false };
+    pthread_barrier_init(&pa.handed_over, NULL, 2);
+    pthread_barrier_init(&pa.freed, NULL, 2);
+
+    pthread_t t;
+    pthread_create(&t, NULL, producer, &pa);
+    pthread_barrier_wait(&pa.handed_over);
+
+    // freeing another thread's objects doesn't fill this thread's cache
+    for (int i = 0; i < 100; i++) {
+        dealloc(pa.ptrs[i]);
+    }
+    assert(thread_caches[7].count == 0);
+
+    pthread_barrier_wait(&pa.freed);
+    pthread_join(t, NULL);
+    assert(pa.got_back);
+
+    pthread_barrier_destroy(&pa.handed_over);
+    pthread_barrier_destroy(&pa.freed);
+}
+
+void test_percpu_cache() {
+    init_allocator();
+    if (alloc_set_percpu_cache(true) != 0) {
+        printf("per-CPU caches unavailable, skipped\n");
+        return;
+    }
+
+    // small objects and medium blocks cycle through the CPU's cache and
+    // never touch the thread cache
+    char *ptrs[200];
+    for (int i = 0; i < 200; i++) {
+        ptrs[i] = alloc(i % 2 ? 64 : 5120);
+        memset(ptrs[i], i, i % 2 ? 64 : 5120);
+    }
+    for (int i = 0; i < 200; i++) {
+        assert(ptrs[i][0] == (char)i);
+        dealloc(ptrs[i]);
+    }
+    assert(thread_caches[7].capacity == 0);
+
+    // switching off hands the cached objects back
+    int err = alloc_set_percpu_cache(false);
+    assert(err == 0);
+    alloc_purge();
+    assert(SLAB_OF(ptrs[1])->used == 0);
+    (void)err;
+}
+
+static void *alloc_medium(void *arg) {
+    (void)arg;
+    return alloc(5120);
+}
+
+void test_arenas() {
+    int err = alloc_set_arenas(MAX_ARENAS + 1, ARENA_ROUND_ROBIN);
+    assert(err == EINVAL);
+    err = alloc_set_arenas(2, ARENA_ROUND_ROBIN);
+    assert(err == 0);
+    init_allocator();
+
+    // consecutive threads land in different arenas, each with its own segment
+    char *mine = alloc(5120);
+    char *theirs;
+    pthread_t t;
+    pthread_create(&t, NULL, alloc_medium, NULL);
+    pthread_join(t, (void **)&theirs);
+
+    assert(SEGMENT_ARENA(mine) != SEGMENT_ARENA(theirs));
+    assert((uintptr_t)mine / SEGMENT_SIZE != (uintptr_t)theirs / SEGMENT_SIZE);
+
+    // a block freed by another thread still goes back to its own arena
+    dealloc(theirs);
+    alloc_thread_flush();
+    assert(block_listed(get_header(theirs)) == true);
+    assert(SEGMENT_ARENA(theirs) != SEGMENT_ARENA(mine));
+
+    dealloc(mine);
+    err = alloc_set_arenas(0, ARENA_ROUND_ROBIN);
+    assert(err == 0);
+    (void)err;
+}
+
+void test_numa() {
+    if (alloc_set_numa(true) != 0) {
+        printf("NUMA layout unavailable, skipped\n");
+        return;
+    }
+    init_allocator();
+
+    // block segments are bound to the node of the arena that mapped them
+    char *p = alloc(5120);
+    int node = heap_node_of(p);
+    assert(node >= 0 && node < alloc_numa_nodes());
+
+    alloc_node_stats_t stats;
+    int err = alloc_node_stats(node, &stats);
+    assert(err == 0);
+    assert(stats.mapped >= SEGMENT_SIZE);
+    assert(stats.arenas > 0);
+    err = alloc_node_stats(alloc_numa_nodes(), &stats);
+    assert(err == EINVAL);
+    (void)err;
+
+    dealloc(p);
+    alloc_set_numa(alloc_numa_nodes() > 1);
+}
+
+void test_realloc() {
+    init_allocator();
+    alloc_set_thread_cache(false);
+
+    // grows into the free block after it
+    char *p = alloc(5120);
+    char *q = alloc(5120);
+    memset(p, 'p', 5120);
+    dealloc(q);
+    char *r = alloc_realloc(p, 9000);
+    assert(r == p && r[0] == 'p' && r[5119] == 'p');
+    assert(alloc_usable_size(r) >= 9000);
+
+    // grows into the rest of the thread's span
+    char *s = alloc(5120);
+    char *t = alloc_realloc(s, 12000);
+    assert(t == s);
+
+    // shrinks in place, freeing the tail
+    t = alloc_realloc(s, 5000);
+    assert(t == s);
+    assert(alloc_usable_size(s) == 5128);
+    assert(block_listed(get_header(s + 5128 + HEADER_SIZE)) == true);
+
+    // slab objects stay put within their class and move otherwise
+    char *a = alloc(64);
+    strcpy(a, "slab");
+    t = alloc_realloc(a, 60);
+    assert(t == a);
+    char *b = alloc_realloc(a, 500);
+    assert(b != a && strcmp(b, "slab") == 0);
+
+    // large objects are remapped
+    char *l = alloc(200000);
+    memset(l, 'l', 200000);
+    l = alloc_realloc(l, 400000);
+    assert(l[199999] == 'l' && alloc_usable_size(l) >= 400000);
+    l = alloc_realloc(l, 1000);
+    assert(SEGMENT_KIND(l) == SEGMENT_SLABS && l[999] == 'l');
+
+    t = alloc_realloc(l, 0);
+    assert(t == NULL);
+    (void)t;
+    char *n = alloc_realloc(NULL, 100);
+    assert(n != NULL);
+    dealloc(n);
+    dealloc(b);
+    dealloc(r);
+    dealloc(s);
+    alloc_set_thread_cache(true);
+}
+
+void test_calloc() {
+    init_allocator();
+
+    // a reused block is cleared, fresh memory needn't be
+    char *p = alloc(5120);
+    memset(p, 0xab, 5120);
+    dealloc(p);
+    char *c = alloc_calloc(1, 5120);
+    for (int i = 0; i < 5120; i++) assert(c[i] == 0);
+
+    char *s = alloc(64);
+    memset(s, 0xab, 64);
+    dealloc(s);
+    char *z = alloc_calloc(8, 8);
+    for (int i = 0; i < 64; i++) assert(z[i] == 0);
+
+    char *l = alloc_calloc(1000, 1000);
+    for (int i = 0; i < 1000000; i += 4096) assert(l[i] == 0);
+
+    char *none = alloc_calloc(SIZE_MAX / 2, 4);
+    assert(none == NULL);
+    (void)none;
+    dealloc(c);
+    dealloc(z);
+    dealloc(l);
+}
+
+void test_aligned() {
+    init_allocator();
+
+    size_t sizes[] = {24, 3000, 20000, 100000};
+    char *ptrs[13 * 4];
+    int n = 0;
+    for (size_t align = 16; align <= 65536; align *= 2) {
+        for (int i = 0; i < 4; i++) {
+            char *p = alloc_aligned(align, sizes[i]);
+            assert(p != NULL && (uintptr_t)p % align == 0);
+            assert(alloc_usable_size(p) >= sizes[i]);
+            memset(p, n, sizes[i]);
+            ptrs[n++] = p;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        assert(ptrs[i][0] == (char)i && ptrs[i][sizes[i % 4] - 1] == (char)i);
+        dealloc(ptrs[i]);
+    }
+
+    // sizes rounded to ALLOC_ALIGN come back aligned from alloc() itself,
+    // from slabs, blocks of every class and large mappings alike
+    for (int32 size = ALLOC_ALIGN; size <= 160000; size += ALLOC_ALIGN * 7) {
+        char *p = alloc(size);
+        assert(p != NULL && (uintptr_t)p % ALLOC_ALIGN == 0);
+        dealloc(p);
+    }
+
+    void *p = alloc_aligned(24, 100);
+    assert(p == NULL && errno == EINVAL);
+    int err = alloc_posix_memalign(&p, 4, 100);
+    assert(err == EINVAL);
+    err = alloc_posix_memalign(&p, 0, 100);
+    assert(err == EINVAL);
+    err = alloc_posix_memalign(&p, 64, 100);
+    assert(err == 0 && (uintptr_t)p % 64 == 0);
+    dealloc(p);
+    (void)err;
+
+    errno = 0;
+    p = alloc_realloc(NULL, (size_t)UINT32_MAX + 1);
+    assert(p == NULL && errno == ENOMEM);
+}
+
+typedef struct {
+    pthread_barrier_t allocated;
+    pthread_barrier_t freed;
+    char *ptr;
+} handover_arg;
+
+// allocates an object for another thread and stays alive while it is freed
+static void *alloc_for_other(void *arg) {
+    handover_arg *ha = arg;
+    ha->ptr = alloc(100);
+    pthread_barrier_wait(&ha->allocated);
+    pthread_barrier_wait(&ha->freed);
+    return NULL;
+}
+
+void test_dealloc_sized() {
+    init_allocator();
+
+    // small objects go straight to the cache slot of the size's class
+    char *ptrs[10];
+    for (int i = 0; i < 10; i++) ptrs[i] = alloc(100);
+    int class = SLAB_OF(ptrs[0])->size_class;
+    int before = thread_caches[class].count;
+    for (int i = 0; i < 10; i++) dealloc_sized(ptrs[i], 100);
+    assert(thread_caches[class].count == before + 10);
+    char *again = alloc(100);
+    assert(again == ptrs[9]);
+    (void)again;
+
+    // objects of another thread's slab still go back to it
+    handover_arg ha;
+    pthread_barrier_init(&ha.allocated, NULL, 2);
+    pthread_barrier_init(&ha.freed, NULL, 2);
+    pthread_t t;
+    pthread_create(&t, NULL, alloc_for_other, &ha);
+    pthread_barrier_wait(&ha.allocated);
+    before = thread_caches[class].count;
+    dealloc_sized(ha.ptr, 100);
+    assert(thread_caches[class].count == before);
+    pthread_barrier_wait(&ha.freed);
+    pthread_join(t, NULL);
+    pthread_barrier_destroy(&ha.allocated);
+    pthread_barrier_destroy(&ha.freed);
+
+    // blocks and large objects take the unsized path
+    char *b = alloc(5120);
+    dealloc_sized(b, 5120);
+    char *reused = alloc(5120);
+    assert(reused == b);
+    (void)reused;
+    dealloc_sized(alloc(200000), 200000);
+    dealloc_sized(NULL, 8);
+}
+
+static void *alloc_ten_and_exit(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 10; i++) alloc(64);
+    return NULL;
+}
+
+void test_stats() {
+    init_allocator();
+
+    // 64 bytes is class 7: one miss refills the cache, the rest are hits
+    char *ptrs[100];
+    for (int i = 0; i < 100; i++) ptrs[i] = alloc(64);
+    for (int i = 0; i < 100; i++) dealloc(ptrs[i]);
+    char *big = alloc(20000);
+    char *large = alloc(200000);
+
+    alloc_stats_t mine;
+    alloc_thread_stats(&mine);
+    alloc_class_stats_t *c = &mine.classes[7];
+    assert(c->allocs == 100 && c->frees == 100);
+    assert(c->alloc_bytes == 6400 && c->free_bytes == 6400);
+    assert(c->cache_misses >= 1 && c->refills >= 1);
+    assert(c->cache_hits + c->cache_misses == 100);
+    assert(mine.classes[TOP_CLASS].allocs == 1);
+    assert(mine.classes[STATS_LARGE].alloc_bytes >= 200000);
+    assert(mine.total.allocs == 102 && mine.active_bytes >= 220000);
+
+    // an exited thread's counts are kept in the heap-wide sums
+    pthread_t t;
+    pthread_create(&t, NULL, alloc_ten_and_exit, NULL);
+    pthread_join(t, NULL);
+
+    alloc_stats_t all;
+    alloc_stats(&all);
+    assert(all.classes[7].allocs == 110);
+    assert(all.active_bytes == mine.active_bytes + 640);
+    assert(all.large_bytes >= 200000 && all.segment_bytes >= 2 * SEGMENT_SIZE);
+    assert(all.threads >= 1);
+
+    // JSON reports the length it needs whatever buffer it gets
+    char buf[16384];
+    int n = alloc_stats_json(buf, sizeof(buf));
+    assert(n > 0 && n < (int)sizeof(buf) && (size_t)n == strlen(buf));
+    assert(strncmp(buf, "{\"segment_bytes\":", 17) == 0 && buf[n - 1] == '}');
+    assert(strstr(buf, "\"class\":7,\"size\":64,\"allocs\":110,") != NULL);
+    char small[16];
+    int m = alloc_stats_json(small, sizeof(small));
+    assert(m == n && strlen(small) == 15);
+    (void)m;
+
+    dealloc(big);
+    dealloc(large);
+}
+
+void test_heap_report() {
+    init_allocator();
+
+    // 100 objects of class 7, half of them freed into the thread cache
+    char *ptrs[100];
+    for (int i = 0; i < 100; i++) ptrs[i] = alloc(64);
+    for (int i = 0; i < 50; i++) dealloc(ptrs[i]);
+
+    // three blocks of the top class, the middle one freed onto its list
+    char *a = alloc(20000), *b = alloc(20000), *c = alloc(20000);
+    dealloc(b);
+
+    alloc_heap_report_t r;
+    alloc_heap_report(&r);
+    alloc_heap_class_t *small = &r.classes[7];
+    assert(small->live_objects == 50 && small->live_bytes == 50 * 64);
+    assert(small->cached_objects >= (uint64_t)thread_caches[7].count);
+    assert(small->live_objects + small->cached_objects + small->free_objects >= 100);
+    assert(r.thread_cache_bytes >= 64 * (size_t)thread_caches[7].count);
+    assert(r.classes[TOP_CLASS].free_objects >= 1 && r.free_list_bytes >= 20000);
+    assert(r.largest_free >= 20000 && r.largest_free <= r.free_list_bytes + r.unclaimed_bytes);
+    assert(r.fragmentation >= 0 && r.fragmentation < 1);
+    assert(r.utilization > 0 && r.utilization <= 1);
+    assert(r.block_bytes >= SEGMENT_SIZE && r.slab_bytes >= SEGMENT_SIZE);
+
+    // flushing empties the caches into the slabs, lists and transfer caches
+    alloc_thread_flush();
+    alloc_heap_report(&r);
+    assert(r.thread_cache_bytes == 0);
+
+    char buf[16384];
+    int n = alloc_heap_report_json(buf, sizeof(buf));
+    assert(n > 0 && (size_t)n == strlen(buf));
+    assert(strncmp(buf, "{\"block_bytes\":", 15) == 0 && strcmp(buf + n - 2, "]}") == 0);
+    assert(strstr(buf, "\"class\":7,\"size\":64,\"live\":50,") != NULL);
+
+    for (int i = 50; i < 100; i++) dealloc(ptrs[i]);
+    dealloc(a);
+    dealloc(c);
+
+    // the tail a shrink splits off is small enough for a slab class, but
+    // it is an arena free block and counts as a fragment
+    alloc_set_thread_cache(false);
+    char *p = alloc(5120), *guard = alloc(5120);
+    char *q = alloc_realloc(p, 4096);
+    assert(q == p);
+    alloc_heap_report(&r);
+    assert(r.fragment_bytes >= 512 && r.free_list_bytes >= r.fragment_bytes);
+    assert(r.classes[7].free_bytes == CLASS_BYTES(7) * r.classes[7].free_objects);
+    dealloc(p);
+    dealloc(guard);
+    alloc_set_thread_cache(true);
+}
+
+// a call site of its own for the profiler to record
+__attribute__((noinline))
+static void *profiled_site(int32 bytes) {
+    return alloc(bytes);
+}
+
+// read a profile dump back and parse its header
+static void read_profile(char *buf, size_t len, unsigned long long counts[4], size_t *rate) {
+    char path[] = "/tmp/test_profile_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+
+    int err = alloc_profile_dump(fd);
+    assert(err == 0);
+    lseek(fd, 0, SEEK_SET);
+    ssize_t n = read(fd, buf, len - 1);
+    close(fd);
+    assert(n > 0);
+    buf[n] = '\0';
+
+    int fields = sscanf(buf, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu",
+                        &counts[0], &counts[1], &counts[2], &counts[3], rate);
+    assert(fields == 5);
+    (void)err;
+    (void)fields;
+}
+
+void test_profile() {
+    init_allocator();
+    int err = alloc_set_profile_rate(4096);
+    assert(err == 0);
+
+    // one sample per 4 KiB on average over 128 KiB; sampled objects get a
+    // mapping of their own, so they report a page's worth of usable size
+    char *ptrs[2000];
+    int sampled = 0;
+    for (int i = 0; i < 2000; i++) {
+        ptrs[i] = profiled_site(64);
+        memset(ptrs[i], i & 0xff, 64);
+        if (alloc_usable_size(ptrs[i]) > 1024) sampled++;
+    }
+    assert(sampled >= 5 && sampled <= 200);
+
+    static char buf[1 << 20];
+    unsigned long long counts[4];
+    size_t rate;
+    read_profile(buf, sizeof(buf), counts, &rate);
+    assert(rate == 4096);
+    assert(counts[0] == (unsigned long long)sampled && counts[1] == 64ull * sampled);
+    assert(counts[2] >= counts[0]);
+    assert(strstr(buf, "\nMAPPED_LIBRARIES:\n") != NULL);
+
+    // every sample came from the same call site
+    char *line = strchr(buf, '\n') + 1;
+    unsigned long long live = 0, bytes;
+    int fields = sscanf(line, "%llu: %llu [", &live, &bytes);
+    assert(fields == 2 && live == (unsigned long long)sampled);
+    assert(strstr(line, "] @ 0x") != NULL);
+
+    // sampled objects move on realloc and keep their contents
+    for (int i = 0; i < 2000; i++) {
+        if (alloc_usable_size(ptrs[i]) <= 1024) continue;
+        char *q = alloc_realloc(ptrs[i], 200);
+        assert(q != ptrs[i] && q[0] == (char)(i & 0xff) && q[63] == (char)(i & 0xff));
+        ptrs[i] = q;
+        break;
+    }
+
+    for (int i = 0; i < 2000; i++) {
+        assert(ptrs[i][10] == (char)(i & 0xff));
+        dealloc(ptrs[i]);
+    }
+    read_profile(buf, sizeof(buf), counts, &rate);
+    assert(counts[0] == 0 && counts[1] == 0 && counts[2] >= (unsigned long long)sampled);
+
+    // sized frees of sampled slab-sized objects find their mappings too
+    err = alloc_set_profile_rate(64);
+    assert(err == 0);
+    for (int i = 0; i < 10000; i++) {
+        void *p = alloc(32);
+        dealloc_sized(p, 32);
+    }
+    read_profile(buf, sizeof(buf), counts, &rate);
+    assert(counts[0] == 0 && counts[2] > 0);
+
+    err = alloc_set_profile_rate(0);
+    assert(err == 0);
+    (void)err;
+    (void)fields;
+}
+
+void test_latency() {
+    init_allocator();
+
+    alloc_latency_t l;
+    int err = alloc_latency(LATENCY_ALL, &l);
+    if (err == ENOSYS) {
+        printf("latency histograms not built in, skipped\n");
+        return;
+    }
+    assert(err == 0);
+    err = alloc_latency(LATENCY_ALL + 1, &l);
+    assert(err == EINVAL);
+
+    alloc_latency_reset();
+    for (int i = 0; i < 1000; i++) dealloc(alloc(64));
+    dealloc(alloc(200000));
+
+    alloc_latency_t hit, fresh, large, all;
+    err = alloc_latency(LATENCY_HIT, &hit) | alloc_latency(LATENCY_LARGE, &large) |
+          alloc_latency(LATENCY_FRESH, &fresh) | alloc_latency(LATENCY_ALL, &all);
+    assert(err == 0);
+    assert(hit.count >= 990 && large.count == 2 && all.count == 2002);
+    assert(all.p50_ns <= all.p99_ns && all.p99_ns <= all.p999_ns && all.p999_ns <= all.max_ns);
+    assert(all.max_ns > 0);
+
+    alloc_latency_reset();
+    err = alloc_latency(LATENCY_ALL, &all);
+    assert(err == 0 && all.count == 0 && all.max_ns == 0);
+    (void)err;
 }
 
 void test_write_read() {
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
     char *p = alloc(20);
     
@@ -102,24 +840,73 @@ void test_write_read() {
 }
 
 void test_splitting() {
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
+    alloc_set_thread_cache(false);
 
-    char *p1 = alloc(400);
+    char *p1 = alloc(16000);
     dealloc(p1);
-    // show(memspace);
+    // show_heap();
 
-    char *p2 = alloc(40);
-    // show(memspace);
+    char *p2 = alloc(5120);
+    // show_heap();
     header *h2 = get_header(p2);
-    assert(atomic_load(&h2->w) == 10);
+    assert(block_words(h2) == 1282);
+
+    header *remainder = GET_NEXT_HEADER(h2);
+    printf("%d\n", block_words(remainder));
+    // Calculation: 4098 (4000 rounded to its class and aligned) - 1282 (allocated) - overhead words
+    assert(block_words(remainder) == 2814);
+    assert(block_alloced(remainder) == false);
+}
+
+void test_size_class_rounding() {
+    init_allocator();
+
+    // 68 bytes is 17 words, which lands in the 20-word class, so neighbouring
+    // objects in its slab are 80 bytes apart
+    char *p1 = alloc(68);
+    char *p2 = alloc(68);
+    assert(SLAB_OF(p1) == SLAB_OF(p2));
+    assert(p1 - p2 == 80 || p2 - p1 == 80);
+    dealloc(p2);
+
+    // any request in the same class reuses the block
+    dealloc(p1);
+    p2 = alloc(80);
+    assert(p2 == p1);
+    dealloc(p2);
+}
+
+void test_slab_density() {
+    init_allocator();
+    alloc_set_thread_cache(false);
 
-    footer *ftr = GET_FOOTER(h2);
-    header *remainder = GET_NEXT_HEADER(ftr);
-    printf("%d\n", atomic_load(&remainder->w));
-    // Calculation: 100 (original) - 10 (allocated) - overhead words
-    assert(atomic_load(&remainder->w) == 85);
-    assert(atomic_load(&remainder->alloced) == false);
+    // small objects carry no header, so a thousand of them share one slab
+    static char *ptrs[5000];
+    for (int i = 0; i < 1000; i++) {
+        ptrs[i] = alloc(16);
+        assert(SEGMENT_KIND(ptrs[i]) == SEGMENT_SLABS);
+        assert(SLAB_OF(ptrs[i]) == SLAB_OF(ptrs[0]));
+    }
+    for (int i = 1; i < 1000; i++) {
+        assert(ptrs[i] == ptrs[i - 1] + 16);
+    }
+
+    // fill a second slab, then empty both; the one that isn't kept for the
+    // class goes back to the pool and serves a different class
+    for (int i = 1000; i < 5000; i++) {
+        ptrs[i] = alloc(16);
+    }
+    slab_t *first = SLAB_OF(ptrs[0]);
+    slab_t *last = SLAB_OF(ptrs[4999]);
+    assert(first != last);
+
+    for (int i = 0; i < 5000; i++) {
+        dealloc(ptrs[i]);
+    }
+    slab_t *reused = SLAB_OF(alloc(1000));
+    assert(reused == first || reused == last);
+    assert(reused->size_class == 23);
 }
 
 void test_free_null() {
@@ -128,19 +915,155 @@ void test_free_null() {
 }
 
 void test_footer_consistency() {
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
-    char *p = alloc(80);
+    alloc_set_thread_cache(false);
+    char *p = alloc(8000);
+    char *q = alloc(8000);
+    assert(((uintptr_t)p & (ALLOC_ALIGN - 1)) == 0 && ((uintptr_t)q & (ALLOC_ALIGN - 1)) == 0);
 
+    // an allocated block leaves no footer in the header after it
     header *h = get_header(p);
-    footer *f = GET_FOOTER(h);
+    header *next = GET_NEXT_HEADER(h);
+    assert(next == get_header(q));
+    assert(block_alloced(h) && !block_prev_free(next));
+
+    // a listed one does, and its next block merges back into it
+    dealloc(p);
+    assert(block_listed(h) && block_prev_free(next));
+    assert(next->prev_w == block_words(h));
+
+    dealloc(q);
+    assert(block_words(h) == 2 * 2050 + OVERHEAD / sizeof(word));
+    assert(block_prev_free(GET_NEXT_HEADER(h)) && GET_NEXT_HEADER(h)->prev_w == block_words(h));
+}
+
+void test_grow_past_1gib() {
+    init_allocator();
+
+    // 9000 blocks of 120 KiB need more than the old fixed 1 GiB pool
+    const int32 size = 120 * 1024;
+    const int n = 9000;
+    static char *ptrs[9000];
+    for (int i = 0; i < n; i++) {
+        ptrs[i] = alloc(size);
+        assert(ptrs[i] != NULL);
+        ptrs[i][0] = 'A';
+        ptrs[i][size - 1] = 'Z';
+    }
+
+    for (int i = 1; i < n; i++) {
+        assert(ptrs[i] >= ptrs[i - 1] + size);
+    }
+
+    for (int i = 0; i < n; i++) {
+        assert(ptrs[i][0] == 'A' && ptrs[i][size - 1] == 'Z');
+        dealloc(ptrs[i]);
+    }
+}
+
+void test_large_objects() {
+    init_allocator();
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    const int32 size = 1024 * 1024;
+    char *p = alloc(size);
+    assert(p != NULL);
+    assert(p < heap_base || p >= heap_base + HEAP_RESERVE);
+
+    memset(p, 'L', size);
+    assert(p[0] == 'L' && p[size - 1] == 'L');
+
+    // the mapping is gone as soon as it is freed
+    char *first_page = (char *)((uintptr_t)p & ~(page - 1));
+    unsigned char vec[1];
+    dealloc(p);
+    assert(mincore(first_page, page, vec) == -1 && errno == ENOMEM);
+}
+
+// number of pages of [p, p + len) currently backed by physical memory
+static size_t resident_pages(void *p, size_t len) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *start = (char *)((uintptr_t)p & ~(page - 1));
+    size_t n = ((char *)p + len - start + page - 1) / page;
+    unsigned char vec[n];
+    int err = mincore(start, n * page, vec);
+    assert(err == 0);
+    (void)err;
+
+    size_t resident = 0;
+    for (size_t i = 0; i < n; i++) resident += vec[i] & 1;
+    return resident;
+}
+
+// fill and free top class blocks, which go straight back to the global lists
+static size_t fill_and_free(char **ptrs, int n, int32 size) {
+    size_t resident = 0;
+    for (int i = 0; i < n; i++) {
+        ptrs[i] = alloc(size);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], 'A', size);
+        resident += resident_pages(ptrs[i], size);
+    }
+    for (int i = 0; i < n; i++) {
+        dealloc(ptrs[i]);
+    }
+    return resident;
+}
+
+void test_purge() {
+    init_allocator();
+
+    const int32 size = 64 * 1024;
+    const int n = 32;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *ptrs[32];
 
-    assert(atomic_load(&h->w) == atomic_load(&f->w));
-    assert(atomic_load(&h->alloced) == atomic_load(&f->alloced));
+    size_t before = fill_and_free(ptrs, n, size);
+    alloc_purge();
+
+    size_t after = 0;
+    for (int i = 0; i < n; i++) {
+        after += resident_pages(ptrs[i], size);
+    }
+
+    // every block lost everything but its partial edge pages
+    assert(before - after >= n * (size / page - 2));
+}
+
+void test_background_purge() {
+    init_allocator();
+
+    const int32 size = 64 * 1024;
+    const int n = 32;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *ptrs[32];
+
+    // nothing is old enough when dealloc() runs its own purge pass
+    size_t before = fill_and_free(ptrs, n, size);
+    alloc_set_decay_ms(0);
+    int err = alloc_background_purge(true);
+    assert(err == 0);
+
+    // the purge thread wakes up once per PURGE_INTERVAL_MS
+    size_t after = before;
+    for (int tries = 0; tries < 50; tries++) {
+        usleep(100 * 1000);
+        after = 0;
+        for (int i = 0; i < n; i++) {
+            after += resident_pages(ptrs[i], size);
+        }
+        if (before - after >= n * (size / page - 2)) break;
+    }
+
+    err = alloc_background_purge(false);
+    assert(err == 0);
+    alloc_set_decay_ms(PURGE_DECAY_MS);
+    assert(before - after >= n * (size / page - 2));
+    (void)err;
 }
 
 void test_stress_sequential() {
-    memset(memspace, 0, 1024 * 1024 * 1024);
+    init_allocator();
 
     const int NUM_ALLOCS = 1000000;
     void *ptrs[1000];
@@ -189,7 +1112,7 @@ void test_stress_sequential() {
 }
 
 void test_stress_fragmentation() {
-    memset(memspace, 0, 1024 * 1024 * 1024);
+    init_allocator();
 
     void *ptrs[10000];
 
@@ -326,9 +1249,104 @@ void *worker_mixed_sizes(void *arg) {
     return NULL;
 }
 
+// whole batches of one class bounce between threads through the transfer cache
+void *worker_transfer(void *arg) {
+    long tid = (long)arg;
+    char *ptrs[4 * THREAD_CACHE_SIZE];
+
+    for (int round = 0; round < 200; round++) {
+        for (int i = 0; i < 4 * THREAD_CACHE_SIZE; i++) {
+            ptrs[i] = alloc(64);
+            memset(ptrs[i], (char)tid, 64);
+        }
+        for (int i = 0; i < 4 * THREAD_CACHE_SIZE; i++) {
+            assert(ptrs[i][0] == (char)tid && ptrs[i][63] == (char)tid);
+            dealloc(ptrs[i]);
+        }
+    }
+    return NULL;
+}
+
+// threads carving fresh memory side by side must never overlap
+void *worker_fresh(void *arg) {
+    long tid = (long)arg;
+    char *ptrs[500];
+
+    for (int i = 0; i < 500; i++) {
+        ptrs[i] = alloc(3000);
+        memset(ptrs[i], (char)tid, 3000);
+    }
+    for (int i = 0; i < 500; i++) {
+        assert(ptrs[i][0] == (char)tid && ptrs[i][2999] == (char)tid);
+    }
+    return NULL;
+}
+
+// a bounded queue of messages from one producer to one consumer
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *items[64];
+    int head, tail;
+} message_queue;
+
+#define MESSAGES 20000
+
+static void *message_producer(void *arg) {
+    message_queue *q = arg;
+    for (int i = 0; i < MESSAGES; i++) {
+        int32 size = 16 + (i % 32) * 24;
+        char *p = alloc(size);
+        memset(p, 'M', size);
+        p[0] = (char)(i % 32);
+
+        pthread_mutex_lock(&q->lock);
+        while (q->tail - q->head == 64) pthread_cond_wait(&q->cond, &q->lock);
+        q->items[q->tail++ % 64] = p;
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return NULL;
+}
+
+static void *message_consumer(void *arg) {
+    message_queue *q = arg;
+    for (int i = 0; i < MESSAGES; i++) {
+        pthread_mutex_lock(&q->lock);
+        while (q->tail == q->head) pthread_cond_wait(&q->cond, &q->lock);
+        char *p = q->items[q->head++ % 64];
+        pthread_cond_broadcast(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+
+        assert(p[0] == (char)(i % 32) && p[16 + (i % 32) * 24 - 1] == 'M');
+        dealloc(p);
+    }
+    return NULL;
+}
+
+void test_concurrent_remote() {
+    printf("Running concurrent producer/consumer test (4 pairs)...\n");
+    init_allocator();
+
+    message_queue queues[4];
+    pthread_t threads[8];
+    for (int i = 0; i < 4; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        pthread_cond_init(&queues[i].cond, NULL);
+        queues[i].head = queues[i].tail = 0;
+        pthread_create(&threads[2 * i], NULL, message_producer, &queues[i]);
+        pthread_create(&threads[2 * i + 1], NULL, message_consumer, &queues[i]);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("Concurrent producer/consumer test passed\n");
+}
+
 void test_concurrent_basic() {
     printf("Running basic concurrent test (4 threads)...\n");
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
 
     pthread_t threads[4];
@@ -345,7 +1363,6 @@ void test_concurrent_basic() {
 
 void test_concurrent_stress() {
     printf("Running concurrent stress test (8 threads, 10k ops each)...\n");
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
 
     pthread_t threads[8];
@@ -360,9 +1377,115 @@ void test_concurrent_stress() {
     printf("Concurrent stress test passed\n");
 }
 
+void test_concurrent_transfer() {
+    printf("Running concurrent transfer cache test (8 threads)...\n");
+    init_allocator();
+
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++) {
+        pthread_create(&threads[i], NULL, worker_transfer, (void *)(long)i);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("Concurrent transfer cache test passed\n");
+}
+
+void test_concurrent_fresh() {
+    printf("Running concurrent fresh memory test (8 threads)...\n");
+    init_allocator();
+
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++) {
+        pthread_create(&threads[i], NULL, worker_fresh, (void *)(long)i);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("Concurrent fresh memory test passed\n");
+}
+
+void test_concurrent_percpu() {
+    printf("Running concurrent per-CPU cache test (8 threads)...\n");
+    init_allocator();
+    if (alloc_set_percpu_cache(true) != 0) {
+        printf("per-CPU caches unavailable, skipped\n");
+        return;
+    }
+
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++) {
+        pthread_create(&threads[i], NULL, i % 2 ? worker_transfer : worker_mixed_sizes,
+                       (void *)(long)i);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    alloc_set_percpu_cache(false);
+    printf("Concurrent per-CPU cache test passed\n");
+}
+
+// the report runs alongside threads allocating and freeing
+void test_concurrent_heap_report() {
+    printf("Running concurrent heap report test (8 threads)...\n");
+    init_allocator();
+
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++) {
+        pthread_create(&threads[i], NULL, worker_mixed_sizes, (void *)(long)i);
+    }
+
+    alloc_heap_report_t r;
+    for (int i = 0; i < 50; i++) {
+        alloc_heap_report(&r);
+        assert(r.fragmentation >= 0 && r.fragmentation <= 1);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    alloc_heap_report(&r);
+    assert(r.thread_cache_bytes == 0);
+
+    printf("Concurrent heap report test passed\n");
+}
+
+void test_concurrent_profile() {
+    printf("Running concurrent heap profile test (8 threads)...\n");
+    init_allocator();
+    int err = alloc_set_profile_rate(1024);
+    assert(err == 0);
+
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++) {
+        pthread_create(&threads[i], NULL, worker_mixed_sizes, (void *)(long)i);
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    for (int i = 0; i < 10; i++) {
+        err = alloc_profile_dump(null_fd);
+        assert(err == 0);
+    }
+    close(null_fd);
+    (void)err;
+
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    alloc_set_profile_rate(0);
+    printf("Concurrent heap profile test passed\n");
+}
+
 void test_concurrent_mixed_sizes() {
     printf("Running concurrent mixed sizes test (16 threads)...\n");
-    memset(memspace, 0, 1024 * 1024 * 1024);
     init_allocator();
 
     pthread_t threads[16];
@@ -387,10 +1510,34 @@ int main(int argc, char *argv[]) {
         test_forward_coalesce();
         test_backward_coalesce();
         test_full_coalesce();
+        test_unlink_from_middle();
+        test_flush_coalesces();
+        test_transfer_cache();
+        test_adaptive_cache();
+        test_span_retire();
+        test_thread_exit_flush();
+        test_remote_free();
+        test_percpu_cache();
+        test_arenas();
+        test_numa();
+        test_realloc();
+        test_calloc();
+        test_aligned();
+        test_dealloc_sized();
+        test_stats();
+        test_heap_report();
+        test_profile();
+        test_latency();
         test_write_read();
         test_splitting();
+        test_size_class_rounding();
+        test_slab_density();
         test_free_null();
         test_footer_consistency();
+        test_grow_past_1gib();
+        test_large_objects();
+        test_purge();
+        test_background_purge();
 
         printf("All unit tests passed\n");
 
@@ -404,6 +1551,12 @@ int main(int argc, char *argv[]) {
         printf("Running concurrent tests\n");
         test_concurrent_basic();
         test_concurrent_stress();
+        test_concurrent_transfer();
+        test_concurrent_fresh();
+        test_concurrent_remote();
+        test_concurrent_percpu();
+        test_concurrent_heap_report();
+        test_concurrent_profile();
         test_concurrent_mixed_sizes();
         printf("All concurrent tests passed\n");
 
@@ -415,10 +1568,34 @@ int main(int argc, char *argv[]) {
         test_forward_coalesce();
         test_backward_coalesce();
         test_full_coalesce();
+        test_unlink_from_middle();
+        test_flush_coalesces();
+        test_transfer_cache();
+        test_adaptive_cache();
+        test_span_retire();
+        test_thread_exit_flush();
+        test_remote_free();
+        test_percpu_cache();
+        test_arenas();
+        test_numa();
+        test_realloc();
+        test_calloc();
+        test_aligned();
+        test_dealloc_sized();
+        test_stats();
+        test_heap_report();
+        test_profile();
+        test_latency();
         test_write_read();
         test_splitting();
+        test_size_class_rounding();
+        test_slab_density();
         test_free_null();
         test_footer_consistency();
+        test_grow_past_1gib();
+        test_large_objects();
+        test_purge();
+        test_background_purge();
         printf("All unit tests passed\n\n");
 
         // printf("Running stress tests\n");
@@ -431,6 +1608,12 @@ int main(int argc, char *argv[]) {
         test_concurrent_basic();
         printf("1");
         test_concurrent_stress();
+        test_concurrent_transfer();
+        test_concurrent_fresh();
+        test_concurrent_remote();
+        test_concurrent_percpu();
+        test_concurrent_heap_report();
+        test_concurrent_profile();
         printf("2");
         test_concurrent_mixed_sizes();
         printf("All concurrent tests passed\n\n");